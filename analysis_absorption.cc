@@ -3,6 +3,15 @@
 #include <fstream>
 #include <iomanip>
 #include <vector>
+#include <algorithm>
+#include <memory>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdio>
+#include <unistd.h>
 #include <TROOT.h>
 #include <TApplication.h>
 #include <TStyle.h>
@@ -19,6 +28,17 @@
 #include "WCSimRootEvent.hh"
 #include "WCSimRootGeom.hh"
 #include "WCSimRootOptions.hh"
+#ifdef USE_RNTUPLE
+#include <RVersion.h>
+#include <ROOT/RNTupleModel.hxx>
+#include <ROOT/RNTupleWriter.hxx>
+#include <ROOT/RNTupleWriteOptions.hxx>
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,36,0)
+namespace RNTupleNS = ROOT;
+#else
+namespace RNTupleNS = ROOT::Experimental;
+#endif
+#endif
 
 WCSimRootGeom *geo = 0; 
 
@@ -27,6 +47,244 @@ using namespace std;
 const int nPMTtypes = 2;
 double PMTradius[nPMTtypes];
 
+// LI source direction is always perpendicular to the wall
+// Separate treatment for barrel and endcap 
+void SourceDirection(const double* vtxpos, double* vDirSource) {
+  double endcapZ=3000;
+  if (abs(vtxpos[2])<endcapZ) {
+    vDirSource[0]=vtxpos[0];
+    vDirSource[1]=vtxpos[1];
+    double norm = sqrt(vtxpos[0]*vtxpos[0]+vtxpos[1]*vtxpos[1]);
+    vDirSource[0]/=-norm;
+    vDirSource[1]/=-norm;
+    vDirSource[2]=0;
+  } else {
+    vDirSource[0]=0;
+    vDirSource[1]=0;
+    if (vtxpos[2]>endcapZ) vDirSource[2]=-1;
+    else vDirSource[2]=1;
+  }
+}
+
+// Index of the source at vtxpos in the list of source positions seen so far, adding it if it is new
+int FindSource(std::vector<std::vector<double> >& sourcePos, const double* vtxpos) {
+  const double tolerance = 1; // cm
+  for (size_t s=0;s<sourcePos.size();s++) {
+    if (fabs(sourcePos[s][0]-vtxpos[0])<tolerance && fabs(sourcePos[s][1]-vtxpos[1])<tolerance &&
+        fabs(sourcePos[s][2]-vtxpos[2])<tolerance) return s;
+  }
+  sourcePos.push_back(std::vector<double>(vtxpos,vtxpos+3));
+  return sourcePos.size()-1;
+}
+
+// One row of the hitRate_pmtType* trees, buffered in memory when writing PMT-sorted output
+struct HitRecord {
+  double nPE, dist, costh, costh_mPMT, cosths, timetof, time;
+  int PMT_id, mPMT_PMTNo, evt, source_id;
+};
+
+// Point the branches of a hitRate_pmtType* tree at hit, so that it can be filled from a record instead of the
+// event loop variables
+void BindHitBranches(TTree* t, HitRecord& hit, double& nHits) {
+  t->SetBranchAddress("nHits",&nHits);
+  t->SetBranchAddress("nPE",&hit.nPE);
+  t->SetBranchAddress("dist",&hit.dist);
+  t->SetBranchAddress("costh",&hit.costh);
+  t->SetBranchAddress("cosths",&hit.cosths);
+  t->SetBranchAddress("timetof",&hit.timetof);
+  t->SetBranchAddress("time",&hit.time);
+  t->SetBranchAddress("PMT_id",&hit.PMT_id);
+  t->SetBranchAddress("evt",&hit.evt);
+  t->SetBranchAddress("source_id",&hit.source_id);
+  if (t->GetBranch("costh_mPMT")) {
+    t->SetBranchAddress("costh_mPMT",&hit.costh_mPMT);
+    t->SetBranchAddress("mPMT_PMTNo",&hit.mPMT_PMTNo);
+  }
+}
+
+// Bounded FIFO between two stages of the pipelined reduction. Counts the time spent waiting on each side and the
+// queue depth seen by the consumer.
+template <class T> class StageQueue {
+ public:
+  double pushWait = 0, popWait = 0; // s
+  double depthSum = 0;
+  long nPop = 0;
+  size_t maxDepth = 0;
+
+  StageQueue(size_t capacity) : capacity(capacity) {}
+
+  void Push(T item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto start = std::chrono::steady_clock::now();
+    notFull.wait(lock,[&]() { return items.size()<capacity; });
+    pushWait += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    items.push_back(std::move(item));
+    maxDepth = std::max(maxDepth,items.size());
+    notEmpty.notify_one();
+  }
+
+  // false once the queue is closed and empty
+  bool Pop(T& item) {
+    std::unique_lock<std::mutex> lock(mutex);
+    auto start = std::chrono::steady_clock::now();
+    notEmpty.wait(lock,[&]() { return !items.empty() || closed; });
+    popWait += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+    if (items.empty()) return false;
+    depthSum += items.size();
+    nPop++;
+    item = std::move(items.front());
+    items.pop_front();
+    notFull.notify_one();
+    return true;
+  }
+
+  void Close() {
+    std::lock_guard<std::mutex> lock(mutex);
+    closed = true;
+    notEmpty.notify_all();
+  }
+
+  double AverageDepth() const { return nPop>0 ? depthSum/nPop : 0; }
+
+ private:
+  size_t capacity;
+  bool closed = false;
+  std::deque<T> items;
+  std::mutex mutex;
+  std::condition_variable notEmpty, notFull;
+};
+
+// Slot of the pipelined reduction, the reader thread reads event ev into it. The slots are recycled, the event in
+// a slot is reallocated by each read
+struct EventSlot {
+  int ev;
+  WCSimRootEvent* event;
+  WCSimRootEvent* event2;
+};
+
+#ifdef USE_RNTUPLE
+// hitRate_pmtType* written as an RNTuple with the same columns as the TTree. compression is a ROOT compression
+// setting (e.g. 505 = zstd level 5), negative keeps the RNTuple default.
+struct HitNTuple {
+  std::unique_ptr<RNTupleNS::RNTupleWriter> writer;
+  std::shared_ptr<double> nHits, nPE, dist, costh, costh_mPMT, cosths, timetof, time;
+  std::shared_ptr<int> PMT_id, mPMT_PMTNo, evt, source_id;
+
+  HitNTuple(const char* name, bool mPMT, TFile& file, int compression) {
+    auto model = RNTupleNS::RNTupleModel::Create();
+    nHits = model->MakeField<double>("nHits");
+    nPE = model->MakeField<double>("nPE");
+    dist = model->MakeField<double>("dist");
+    costh = model->MakeField<double>("costh");
+    if (mPMT) costh_mPMT = model->MakeField<double>("costh_mPMT");
+    cosths = model->MakeField<double>("cosths");
+    timetof = model->MakeField<double>("timetof");
+    time = model->MakeField<double>("time");
+    PMT_id = model->MakeField<int>("PMT_id");
+    if (mPMT) mPMT_PMTNo = model->MakeField<int>("mPMT_PMTNo");
+    evt = model->MakeField<int>("evt");
+    source_id = model->MakeField<int>("source_id");
+    RNTupleNS::RNTupleWriteOptions options;
+    if (compression>=0) options.SetCompression(compression);
+    writer = RNTupleNS::RNTupleWriter::Append(std::move(model),name,file,options);
+  }
+
+  void Fill(const HitRecord& hit) {
+    *nHits = 1; *nPE = hit.nPE; *dist = hit.dist; *costh = hit.costh; *cosths = hit.cosths;
+    *timetof = hit.timetof; *time = hit.time; *PMT_id = hit.PMT_id; *evt = hit.evt; *source_id = hit.source_id;
+    if (costh_mPMT) { *costh_mPMT = hit.costh_mPMT; *mPMT_PMTNo = hit.mPMT_PMTNo; }
+    writer->Fill();
+  }
+};
+#endif
+
+// 64-bit FNV-1a hash of n bytes, continuing from hash
+const unsigned long long FNV1a_offset = 14695981039346656037ULL;
+void FNV1a(const void* data, size_t n, unsigned long long& hash) {
+  const unsigned char* bytes = (const unsigned char*)data;
+  for (size_t i=0;i<n;i++) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ULL;
+  }
+}
+
+// Size and 64-bit FNV-1a hash of the content of a file, used to recognise inputs that were already reduced
+bool HashFile(const char* path, Long64_t& size, unsigned long long& hash) {
+  std::ifstream in(path, std::ios::binary);
+  if (!in) return false;
+  hash = FNV1a_offset;
+  size = 0;
+  std::vector<char> buffer(1<<20);
+  while (in) {
+    in.read(buffer.data(),buffer.size());
+    std::streamsize n = in.gcount();
+    FNV1a(buffer.data(),n,hash);
+    size += n;
+  }
+  return true;
+}
+
+// Hash of everything the pmt_type0/1 tables are computed from: position, orientation and mPMT numbering of
+// every PMT and the source positions
+unsigned long long GeometryHash(bool hybrid, const std::vector<std::vector<double> >& sourcePos) {
+  unsigned long long hash = FNV1a_offset;
+  for (int pmtType=0;pmtType<nPMTtypes;pmtType++) {
+    int nPMTs = pmtType==0 ? geo->GetWCNumPMT() : (hybrid ? geo->GetWCNumPMT(true) : 0);
+    FNV1a(&nPMTs,sizeof(nPMTs),hash);
+    for (int i=0;i<nPMTs;i++) {
+      WCSimRootPMT pmt = geo->GetPMT(i,pmtType==1);
+      double values[6];
+      for (int j=0;j<3;j++) {
+        values[j] = pmt.GetPosition(j);
+        values[j+3] = pmt.GetOrientation(j);
+      }
+      int mPMT_PMTNo = pmtType==1 ? pmt.GetmPMT_PMTNo() : 0;
+      FNV1a(values,sizeof(values),hash);
+      FNV1a(&mPMT_PMTNo,sizeof(mPMT_PMTNo),hash);
+    }
+  }
+  for (size_t s=0;s<sourcePos.size();s++) FNV1a(sourcePos[s].data(),3*sizeof(double),hash);
+  return hash;
+}
+
+// Whether the manifest of an aggregate file has an entry for this input with the same size and hash. The same file
+// may be given under another path spelling (./f.root, dir//f.root), which is reported but still matches.
+// Each line of the manifest is "size hash path".
+bool InManifest(const std::string& manifest, const char* path, Long64_t size, unsigned long long hash) {
+  std::istringstream in(manifest);
+  std::string line;
+  while (std::getline(in,line)) {
+    std::istringstream ss(line);
+    Long64_t entry_size;
+    unsigned long long entry_hash;
+    std::string entry_path;
+    if (!(ss >> entry_size >> std::hex >> entry_hash)) continue;
+    std::getline(ss >> std::ws, entry_path);
+    if (entry_size==size && entry_hash==hash) {
+      if (entry_path!=path) cout << "Warning: " << path << " has the same size and hash as " << entry_path << " in the manifest" << endl;
+      return true;
+    }
+  }
+  return false;
+}
+
+// Manifest of an aggregate file. It is kept inside the aggregate as the TNamed "manifest", written together with the
+// histograms it describes, and copied to textfile for reading. Aggregates without it fall back to textfile.
+std::string ReadManifest(const char* aggregate, const std::string& textfile) {
+  std::string manifest;
+  if (access(aggregate,F_OK)==0) {
+    TFile* f = TFile::Open(aggregate,"READ");
+    TNamed* stored = f ? (TNamed*)f->Get("manifest") : 0;
+    if (stored) manifest = stored->GetTitle();
+    delete f;
+    if (stored) return manifest;
+  }
+  std::ifstream in(textfile.c_str());
+  std::stringstream text;
+  text << in.rdbuf();
+  return text.str();
+}
+
 double CalcGroupVelocity(double wavelength) {
     const int NUMENTRIES_water=60;
     const double GeV=1.e9;
@@ -114,11 +372,22 @@ int main(int argc, char **argv){
   double nindex = 1.373;//refraction index of water
   bool plotDigitized = true; //using digitized hits
   bool separatedTriggers=false;//Assume two independent triggers, one for mPMT, one for B&L
+  bool sortedOutput=false;//write hits clustered by PMT_id and sorted by timetof, with an offset index
+  bool rawPhotons=false;//bin the true time of every raw photon into per-PMT timetof histograms instead of filling the hit trees
+  bool geometrySidecar=false;//write the pmt_type0/1 tables to a geometry_<hash>.root file shared by all outputs with the same geometry and sources
+  bool ntupleOutput=false;//write the hit data as RNTuple instead of TTree, needs a build with RNTUPLE=1
+  int compression=-1;//ROOT compression setting of the output, negative keeps the default
+  int pipelineDepth=0;//with >0, read events in a reader thread and write the hits in a writer thread, with this many event slots
+  char * rawfilename=NULL;//also write the raw hits (or with -r the raw photon histograms) to this file, from the same pass over the input
+  char * aggregatefilename=NULL;//add the hits to running per-PMT timetof histograms in this file instead of writing the hit trees
+  bool customBinning=false;
+  int nbins_timetof=400;//timetof binning of the photon histograms
+  double timetof_min=-20, timetof_max=80;
 
   int startEvent=0;
   int endEvent=0;
   char c;
-  while( (c = getopt(argc,argv,"f:o:s:e:hdtv")) != -1 ){//input in c the argument (-f etc...) and in optarg the next argument. When the above test becomes -1, it means it fails to find a new argument.
+  while( (c = getopt(argc,argv,"f:o:s:e:b:a:z:R:q:hdtvprgn")) != -1 ){//input in c the argument (-f etc...) and in optarg the next argument. When the above test becomes -1, it means it fails to find a new argument.
     switch(c){
       case 'f':
         filename = optarg;
@@ -135,6 +404,38 @@ int main(int argc, char **argv){
       case 'v':
         verbose = true;
         break;
+      case 'p':
+        sortedOutput = true;
+        break;
+      case 'r':
+        rawPhotons = true;
+        plotDigitized = false; //photon times are only available for raw hits
+        break;
+      case 'b':
+        if (sscanf(optarg,"%d,%lf,%lf",&nbins_timetof,&timetof_min,&timetof_max)!=3 || nbins_timetof<=0 || timetof_max<=timetof_min) {
+          cout << "Error, invalid timetof binning " << optarg << ", expected nbins,min,max" << endl;
+          return -1;
+        }
+        customBinning = true;
+        break;
+      case 'a':
+        aggregatefilename = optarg;
+        break;
+      case 'g':
+        geometrySidecar = true;
+        break;
+      case 'n':
+        ntupleOutput = true;
+        break;
+      case 'z':
+        compression = std::stoi(optarg);
+        break;
+      case 'R':
+        rawfilename = optarg;
+        break;
+      case 'q':
+        pipelineDepth = std::stoi(optarg);
+        break;
       case 'o':
 	      outfilename = optarg;
 	      break;
@@ -150,6 +451,46 @@ int main(int argc, char **argv){
   }
   
 
+  if (rawfilename!=NULL) {
+    if (aggregatefilename!=NULL && rawPhotons) {
+      cout << "Error, -R cannot be combined with both -a and -r" << endl;
+      return -1;
+    }
+    if (!plotDigitized) {
+      cout << "Error, -R writes the digitized hits to the output and the raw hits to its file, it cannot be combined with -d" << endl;
+      return -1;
+    }
+    plotDigitized = true; // digitized hits go to the output, raw hits to rawfilename
+  }
+  if (aggregatefilename!=NULL || (rawPhotons && rawfilename==NULL)) ntupleOutput = false; // no hit rows are written
+#ifndef USE_RNTUPLE
+  if (ntupleOutput) {
+    cout << "Error, RNTuple output needs analysis_absorption built with RNTUPLE=1" << endl;
+    return -1;
+  }
+#endif
+
+  if (pipelineDepth>0) ROOT::EnableThreadSafety();
+
+  // In aggregate mode, skip inputs already listed in the manifest of the aggregate file
+  std::string manifest, manifestText;
+  Long64_t inputSize = 0;
+  unsigned long long inputHash = 0;
+  if (aggregatefilename!=NULL) {
+    manifest = std::string(aggregatefilename)+".manifest.txt";
+    if (filename==NULL || !HashFile(filename,inputSize,inputHash)) {
+      cout << "Error, could not read input file: " << (filename ? filename : "") << endl;
+      return -1;
+    }
+    manifestText = ReadManifest(aggregatefilename,manifest);
+    if (InManifest(manifestText,filename,inputSize,inputHash)) {
+      cout << filename << " is already in " << aggregatefilename << ", nothing to do" << endl;
+      return 0;
+    }
+    outfilename = aggregatefilename;
+    if (!customBinning && plotDigitized) { timetof_min = -1000; timetof_max = -900; }
+  }
+
   double vg = CalcGroupVelocity(350) / 1.e7;
   cout << "Photon speed in water = " << vg << "cm/ns" << endl;
   
@@ -218,11 +559,63 @@ int main(int argc, char **argv){
 
   if(outfilename==NULL) sprintf(outfilename,"out.root");
   
-  TFile * outfile = new TFile(outfilename,"RECREATE");
+  TFile * outfile = new TFile(outfilename,aggregatefilename!=NULL ? "UPDATE" : "RECREATE");
+  if (compression>=0) outfile->SetCompressionSettings(compression);
   cout<<"File "<<outfilename<<" is open for writing"<<endl;
+  TFile * rawfile = 0;
+  if (rawfilename!=NULL) {
+    rawfile = new TFile(rawfilename,"RECREATE");
+    if (compression>=0) rawfile->SetCompressionSettings(compression);
+    cout<<"File "<<rawfilename<<" is open for writing the raw hits"<<endl;
+    outfile->cd();
+  }
+
+  double vtxpos[3];
+  std::vector<std::vector<double> > sourcePos; // distinct source positions, hits are tagged with their index
+  int nPMTs[nPMTtypes] = {geo->GetWCNumPMT(), hybrid ? geo->GetWCNumPMT(true) : 0};
+  if (aggregatefilename!=NULL) {
+    // continue the source numbering and the timetof binning of the aggregate
+    TTree* aggSources = (TTree*)outfile->Get("sources");
+    if (aggSources) {
+      aggSources->SetBranchAddress("vtx_x",&vtxpos[0]);
+      aggSources->SetBranchAddress("vtx_y",&vtxpos[1]);
+      aggSources->SetBranchAddress("vtx_z",&vtxpos[2]);
+      for (Long64_t i=0;i<aggSources->GetEntries();i++) {
+        aggSources->GetEntry(i);
+        sourcePos.push_back(std::vector<double>(vtxpos,vtxpos+3));
+      }
+      delete aggSources;
+    }
+    // the aggregate's hash covers its PMTs and sources, so with the same sources it only matches for the same PMTs
+    TNamed* aggHash = (TNamed*)outfile->Get("geometry_hash");
+    if (aggHash) {
+      std::string inputHashString = Form("%016llx",GeometryHash(hybrid,sourcePos));
+      if (inputHashString!=aggHash->GetTitle()) {
+        cout << "Error, " << filename << " has a different geometry than " << aggregatefilename << endl;
+        return -1;
+      }
+      delete aggHash;
+    }
+    else if (!sourcePos.empty()) cout << "Warning, " << aggregatefilename << " has no geometry hash, the geometry is not checked" << endl;
+    TH2D* aggTimetof = (TH2D*)outfile->Get("hTimetof_pmtType0");
+    if (aggTimetof) {
+      if (aggTimetof->GetNbinsX()!=nPMTs[0]) {
+        cout << "Error, " << aggregatefilename << " was built with a different number of PMTs" << endl;
+        return -1;
+      }
+      nbins_timetof = aggTimetof->GetNbinsY();
+      timetof_min = aggTimetof->GetYaxis()->GetXmin();
+      timetof_max = aggTimetof->GetYaxis()->GetXmax();
+      delete aggTimetof;
+    }
+    cout << "Adding to " << aggregatefilename << " with " << sourcePos.size() << " sources and " << nbins_timetof
+         << " timetof bins in [" << timetof_min << ", " << timetof_max << "] ns" << endl;
+  }
 
   double nHits, nPE, dist, costh, costh_mPMT, timetof, cosths, time;
   int PMT_id, mPMT_PMTNo; //mPMT_id
+  int evt; // event number, used to resample blocks of events in the fit
+  int source_id; // index of the source position in the sources tree
   // TTree for storing the hit information. One for B&L PMT<, one for mPMT
   TTree* hitRate_pmtType0 = new TTree("hitRate_pmtType0","hitRate_pmtType0");
   hitRate_pmtType0->Branch("nHits",&nHits); // dummy variable, always equal to 1
@@ -233,6 +626,8 @@ int main(int argc, char **argv){
   hitRate_pmtType0->Branch("timetof",&timetof); // hittime-tof
   hitRate_pmtType0->Branch("time",&time); // hittime
   hitRate_pmtType0->Branch("PMT_id",&PMT_id);
+  hitRate_pmtType0->Branch("evt",&evt);
+  hitRate_pmtType0->Branch("source_id",&source_id);
   TTree* hitRate_pmtType1 = new TTree("hitRate_pmtType1","hitRate_pmtType1");
   hitRate_pmtType1->Branch("nHits",&nHits);
   hitRate_pmtType1->Branch("nPE",&nPE);
@@ -244,13 +639,135 @@ int main(int argc, char **argv){
   hitRate_pmtType1->Branch("time",&time);
   hitRate_pmtType1->Branch("PMT_id",&PMT_id);
   hitRate_pmtType1->Branch("mPMT_PMTNo",&mPMT_PMTNo); //sub-ID of PMT inside a mPMT module
+  hitRate_pmtType1->Branch("evt",&evt);
+  hitRate_pmtType1->Branch("source_id",&source_id);
+  // With -R the raw hits are filled into plain trees of the same layout in rawfile
+  TTree* rawHitRate[nPMTtypes] = {0,0};
+  if (rawfile) {
+    for (int pmtType=0;pmtType<nPMTtypes;pmtType++) {
+      rawfile->cd();
+      rawHitRate[pmtType] = (pmtType==0 ? hitRate_pmtType0 : hitRate_pmtType1)->CloneTree(0);
+      rawHitRate[pmtType]->SetDirectory(rawfile);
+    }
+    outfile->cd();
+  }
+#ifdef USE_RNTUPLE
+  std::unique_ptr<HitNTuple> hitNTuple[nPMTtypes];
+  if (ntupleOutput) {
+    for (int pmtType=0;pmtType<nPMTtypes;pmtType++)
+      hitNTuple[pmtType].reset(new HitNTuple(Form("hitRate_pmtType%i",pmtType),pmtType==1,*outfile,compression));
+  }
+#endif
+
+  // In raw photon and aggregate mode the charge is counted in per-source buffers of nPMTs x nbins_timetof,
+  // indexed PMT_id*nbins_timetof+bin
+  double timetof_width = (timetof_max-timetof_min)/nbins_timetof;
+  std::vector<std::vector<double> > timetofCounts[nPMTtypes];
+  double nPhotons = 0, nPhotonsOutside = 0;
+  auto binHit = [&](int pmtType, double t, double weight) {
+    nPhotons += weight;
+    if (t<timetof_min || t>=timetof_max) { nPhotonsOutside += weight; return; }
+    int bin = (int)((t-timetof_min)/timetof_width);
+    if (bin>=nbins_timetof) bin = nbins_timetof-1;
+    timetofCounts[pmtType][source_id][(size_t)PMT_id*nbins_timetof+bin] += weight;
+  };
+
+  // Output of a hit row. target 0/1 = hitRate_pmtType0/1, 2/3 = the raw hit trees of -R.
+  // With the writer thread of -q the tree branches are bound to writerHit, which is set from each queued record.
+  bool pipelineWriter = pipelineDepth>0 && !sortedOutput;
+  HitRecord writerHit;
+  double writerNHits = 1;
+  if (pipelineWriter) {
+    BindHitBranches(hitRate_pmtType0,writerHit,writerNHits);
+    BindHitBranches(hitRate_pmtType1,writerHit,writerNHits);
+    for (int pmtType=0;pmtType<nPMTtypes;pmtType++)
+      if (rawHitRate[pmtType]) BindHitBranches(rawHitRate[pmtType],writerHit,writerNHits);
+  }
+  auto writeHit = [&](int target, const HitRecord& hit) {
+#ifdef USE_RNTUPLE
+    if (ntupleOutput && target<2) {
+      hitNTuple[target]->Fill(hit);
+      return;
+    }
+#endif
+    if (pipelineWriter) writerHit = hit;
+    TTree* t = target==0 ? hitRate_pmtType0 : target==1 ? hitRate_pmtType1 : rawHitRate[target-2];
+    t->Fill();
+  };
+  std::vector<std::pair<int,HitRecord> > hitBatch; // hits of the current event, handed to the writer thread
+  auto emitHit = [&](int target) {
+    HitRecord hit = {nPE, dist, costh, costh_mPMT, cosths, timetof, time, PMT_id, mPMT_PMTNo, evt, source_id};
+    if (pipelineWriter) hitBatch.push_back(std::make_pair(target,hit));
+    else writeHit(target,hit);
+  };
+
+  // In sorted mode hits are kept in memory until the end of the event loop, then written PMT by PMT
+  std::vector<HitRecord> sortedHits[nPMTtypes];
+  auto fillHit = [&](int pmtType) {
+    if (aggregatefilename!=NULL) binHit(pmtType, timetof, nPE);
+    else if (sortedOutput) {
+      HitRecord hit = {nPE, dist, costh, costh_mPMT, cosths, timetof, time, PMT_id, mPMT_PMTNo, evt, source_id};
+      sortedHits[pmtType].push_back(hit);
+    }
+    else emitHit(pmtType);
+  };
+
+  // Pipelined reduction (-q): a reader thread decodes events into pipelineDepth slots, which bound the events in
+  // flight, this thread computes the hits, and a writer thread fills and compresses the output trees
+  std::vector<EventSlot> slots(std::max(pipelineDepth,0));
+  StageQueue<EventSlot*> freeSlots(slots.size()+1), readEvents(slots.size()+1);
+  StageQueue<std::vector<std::pair<int,HitRecord> > > writeQueue(std::max(pipelineDepth,1));
+  double readTime = 0, writeTime = 0;
+  std::thread reader, writer;
+  WCSimRootEvent* inputEvent = wcsimrootsuperevent;
+  WCSimRootEvent* inputEvent2 = wcsimrootsuperevent2;
+  if (pipelineDepth>0) {
+    // AutoDelete stays on: the branch deletes and recreates a slot's event when reading into it again, since
+    // ReInitialize only clears the first trigger and the triggers of a reused event would leak
+    for (size_t k=0;k<slots.size();k++) {
+      slots[k].event = new WCSimRootEvent();
+      slots[k].event2 = new WCSimRootEvent();
+      freeSlots.Push(&slots[k]);
+    }
+    reader = std::thread([&]() {
+      for (int ev=startEvent; ev<nevent; ev++) {
+        EventSlot* slot;
+        if (!freeSlots.Pop(slot)) break;
+        branch->SetAddress(&slot->event);
+        if (hybrid) branch2->SetAddress(&slot->event2);
+        auto start = std::chrono::steady_clock::now();
+        tree->GetEntry(ev);
+        readTime += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        slot->ev = ev;
+        readEvents.Push(slot);
+      }
+      readEvents.Close();
+    });
+    if (pipelineWriter) {
+      writer = std::thread([&]() {
+        std::vector<std::pair<int,HitRecord> > batch;
+        while (writeQueue.Pop(batch)) {
+          auto start = std::chrono::steady_clock::now();
+          for (size_t k=0;k<batch.size();k++) writeHit(batch[k].first,batch[k].second);
+          writeTime += std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+        }
+      });
+    }
+  }
+  auto loopStart = std::chrono::steady_clock::now();
 
-  double vtxpos[3];
   // Now loop over events
   for (int ev=startEvent; ev<nevent; ev++)
   {
     // Read the event from the tree into the WCSimRootEvent instance
-    tree->GetEntry(ev);
+    EventSlot* slot = 0;
+    if (pipelineDepth>0) {
+      if (!readEvents.Pop(slot)) break;
+      wcsimrootsuperevent = slot->event;
+      wcsimrootsuperevent2 = slot->event2;
+    }
+    else tree->GetEntry(ev);
+    evt = ev;
 
     wcsimrootevent = wcsimrootsuperevent->GetTrigger(0);
     if(hybrid) wcsimrootevent2 = wcsimrootsuperevent2->GetTrigger(0);
@@ -269,24 +786,14 @@ int main(int argc, char **argv){
     }
 
     for (int i=0;i<3;i++) vtxpos[i]=wcsimrootevent->GetVtx(i);
+    source_id = FindSource(sourcePos,vtxpos);
+    if (rawPhotons || aggregatefilename!=NULL) {
+      for (int pmtType=0;pmtType<nPMTtypes;pmtType++)
+        if ((int)timetofCounts[pmtType].size()<=source_id) timetofCounts[pmtType].resize(source_id+1,std::vector<double>((size_t)nPMTs[pmtType]*nbins_timetof,0));
+    }
 
-    // LI source direction is always perpendicular to the wall
-    // Separate treatment for barrel and endcap 
     double vDirSource[3];
-    double endcapZ=3000;
-    if (abs(vtxpos[2])<endcapZ) {
-      vDirSource[0]=vtxpos[0];
-      vDirSource[1]=vtxpos[1];
-      double norm = sqrt(vtxpos[0]*vtxpos[0]+vtxpos[1]*vtxpos[1]);
-      vDirSource[0]/=-norm;
-      vDirSource[1]/=-norm;
-      vDirSource[2]=0;
-    } else {
-      vDirSource[0]=0;
-      vDirSource[1]=0;
-      if (vtxpos[2]>endcapZ) vDirSource[2]=-1;
-      else vDirSource[2]=1;
-    }
+    SourceDirection(vtxpos,vDirSource);
 
     if(verbose){
       printf("Jmu %d\n", wcsimrootevent->GetJmu());
@@ -349,7 +856,7 @@ int main(int argc, char **argv){
       cout << "RAW HITS:" << endl;
     }
 
-    if(!plotDigitized) for(int pmtType=0;pmtType<nPMTtypes;pmtType++){
+    if(!plotDigitized || rawfile) for(int pmtType=0;pmtType<nPMTtypes;pmtType++){
       if(separatedTriggers){
         if(triggerInfo2.size()!=0 && pmtType==0) continue;
         if(triggerInfo.size()!=0 && pmtType==1) continue;
@@ -427,6 +934,15 @@ int main(int argc, char **argv){
         }
 
         if(pmtType == 1) mPMT_PMTNo = pmt.GetmPMT_PMTNo();
+
+        if (rawPhotons) {
+          // the photons of this tube are stored contiguously in timeArray from timeArrayIndex
+          for (int j=timeArrayIndex; j<timeArrayIndex+peForTube; j++) {
+            WCSimRootCherenkovHitTime * HitTime = (WCSimRootCherenkovHitTime*) timeArray->At(j);
+            binHit(pmtType, HitTime->GetTruetime()-tof, 1);
+          }
+          continue;
+        }
         
         WCSimRootCherenkovHitTime * HitTime = (WCSimRootCherenkovHitTime*) timeArray->At(i);//Takes the first hit of the array as the timing, It should be the earliest hit
         //WCSimRootCherenkovHitTime HitTime = (WCSimRootCherenkovHitTime) timeArray->At(j);		  
@@ -438,8 +954,8 @@ int main(int argc, char **argv){
         timetof = time-tof;
         nHits = 1; nPE = peForTube; dist = Norm; costh = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
         cosths = vDir[0]*vDirSource[0]+vDir[1]*vDirSource[1]+vDir[2]*vDirSource[2];
-        if (pmtType==0) hitRate_pmtType0->Fill();
-        if (pmtType==1) hitRate_pmtType1->Fill();
+        if (rawfile) emitHit(2+pmtType);
+        else fillHit(pmtType);
 
       } // End of loop over Cherenkov hits
       if(verbose) cout << "Total Pe : " << totalPe << endl;
@@ -539,7 +1055,7 @@ int main(int argc, char **argv){
 
         nHits = 1; nPE = peForTube; dist = Norm; costh = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
         cosths = vDir[0]*vDirSource[0]+vDir[1]*vDirSource[1]+vDir[2]*vDirSource[2];
-        if (pmtType==0) hitRate_pmtType0->Fill();
+        if (pmtType==0) fillHit(0);
         if (pmtType==1){
             if(mPMT_PMTNo == 19) costh_mPMT = costh;
             else{
@@ -561,7 +1077,7 @@ int main(int argc, char **argv){
                 }
                 costh_mPMT = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
             }
-            hitRate_pmtType1->Fill();
+            fillHit(1);
         }
 
 
@@ -572,105 +1088,283 @@ int main(int argc, char **argv){
     // reinitialize super event between loops.
     wcsimrootsuperevent->ReInitialize();
     if(hybrid) wcsimrootsuperevent2->ReInitialize();
+    if (slot) freeSlots.Push(slot);
+    if (pipelineWriter) {
+      writeQueue.Push(std::move(hitBatch));
+      hitBatch.clear();
+    }
     
   } // End of loop over events
 
-  outfile->cd();
-  hitRate_pmtType0->Write();
-  hitRate_pmtType1->Write();
-  // Save also PMT geometry information
-  TTree* pmt_type0 = new TTree("pmt_type0","pmt_type0");
-  pmt_type0->Branch("dist",&dist);
-  pmt_type0->Branch("costh",&costh);
-  pmt_type0->Branch("cosths",&cosths);
-  pmt_type0->Branch("PMT_id",&PMT_id);
-  TTree* pmt_type1 = new TTree("pmt_type1","pmt_type1");
-  pmt_type1->Branch("dist",&dist);
-  pmt_type1->Branch("costh",&costh);
-  pmt_type1->Branch("costh_mPMT",&costh_mPMT);
-  pmt_type1->Branch("cosths",&cosths);
-  pmt_type1->Branch("PMT_id",&PMT_id);
-  pmt_type1->Branch("mPMT_PMTNo",&mPMT_PMTNo);
-  double vDirSource[3];
-  double endcapZ=3000;
-  if (abs(vtxpos[2])<endcapZ) {
-    vDirSource[0]=vtxpos[0];
-    vDirSource[1]=vtxpos[1];
-    double norm = sqrt(vtxpos[0]*vtxpos[0]+vtxpos[1]*vtxpos[1]);
-    vDirSource[0]/=-norm;
-    vDirSource[1]/=-norm;
-    vDirSource[2]=0;
-  } else {
-    vDirSource[0]=0;
-    vDirSource[1]=0;
-    if (vtxpos[2]>endcapZ) vDirSource[2]=-1;
-    else vDirSource[2]=1;
+  if (pipelineDepth>0) {
+    double loopTime = std::chrono::duration<double>(std::chrono::steady_clock::now()-loopStart).count();
+    freeSlots.Close();
+    writeQueue.Close();
+    reader.join();
+    if (pipelineWriter) writer.join();
+    double totalTime = std::chrono::duration<double>(std::chrono::steady_clock::now()-loopStart).count();
+    for (size_t k=0;k<slots.size();k++) {
+      delete slots[k].event;
+      delete slots[k].event2;
+    }
+    wcsimrootsuperevent = inputEvent;
+    wcsimrootsuperevent2 = inputEvent2;
+    branch->SetAddress(&wcsimrootsuperevent);
+    if (hybrid) branch2->SetAddress(&wcsimrootsuperevent2);
+    cout << "Pipeline with " << pipelineDepth << " event slots, " << totalTime << " s:" << endl;
+    cout << "  reader: " << readTime << " s reading, " << freeSlots.popWait << " s waiting for a free slot" << endl;
+    cout << "  compute: " << loopTime-readEvents.popWait-writeQueue.pushWait << " s, " << readEvents.popWait
+         << " s waiting for events (queue depth " << readEvents.AverageDepth() << " average, " << readEvents.maxDepth << " max), "
+         << writeQueue.pushWait << " s waiting for the writer" << endl;
+    if (pipelineWriter)
+      cout << "  writer: " << writeTime << " s filling, " << writeQueue.popWait << " s waiting for hits (queue depth "
+           << writeQueue.AverageDepth() << " average, " << writeQueue.maxDepth << " max)" << endl;
   }
 
-  int nPMTs_type0=geo->GetWCNumPMT();
-  int nPMTs_type1=0; if (hybrid) nPMTs_type1=geo->GetWCNumPMT(true);
-  for (int pmtType=0;pmtType<nPMTtypes;pmtType++) {
-    int nPMTs_type = pmtType==0 ? nPMTs_type0 : nPMTs_type1;
-    for (int i=0;i<nPMTs_type;i++) {
-      WCSimRootPMT pmt;
-      if (pmtType==0) pmt = geo->GetPMT(i,false);
-      else pmt = geo->GetPMT(i,true);
-      if (pmtType == 0) PMT_id = i;
-      else {
-          PMT_id = i;
-          mPMT_PMTNo = pmt.GetmPMT_PMTNo();
-      }
-      double PMTpos[3];
-      double PMTdir[3];                   
-      for(int j=0;j<3;j++){
-        PMTpos[j] = pmt.GetPosition(j);
-        PMTdir[j] = pmt.GetOrientation(j);
-      }
-      double particleRelativePMTpos[3];
-      for(int j=0;j<3;j++) particleRelativePMTpos[j] = PMTpos[j] - vtxpos[j];
-      double vDir[3];double vOrientation[3];
-      for(int j=0;j<3;j++){
-        vDir[j] = particleRelativePMTpos[j];
-        vOrientation[j] = PMTdir[j];
+  outfile->cd();
+  if (sortedOutput) {
+    // Write hits clustered by PMT_id and ordered by timetof within each PMT.
+    // hitIndex_pmtType* holds one row per hit PMT with the first entry and number of entries of its range,
+    // so that per-channel and time-window queries can seek directly into hitRate_pmtType*
+    Long64_t firstEntry, nEntries;
+    for (int pmtType=0;pmtType<nPMTtypes;pmtType++) {
+      TTree* hitTree = pmtType==0 ? hitRate_pmtType0 : hitRate_pmtType1;
+      TTree* hitIndex = new TTree(Form("hitIndex_pmtType%i",pmtType),Form("hitIndex_pmtType%i",pmtType));
+      hitIndex->Branch("PMT_id",&PMT_id);
+      hitIndex->Branch("first",&firstEntry);
+      hitIndex->Branch("nEntries",&nEntries);
+      std::vector<HitRecord>& hits = sortedHits[pmtType];
+      std::stable_sort(hits.begin(),hits.end(),[](const HitRecord& a, const HitRecord& b) {
+        if (a.PMT_id!=b.PMT_id) return a.PMT_id<b.PMT_id;
+        return a.timetof<b.timetof;
+      });
+      Long64_t entry = 0;
+      for (size_t k=0;k<hits.size();k++) {
+        const HitRecord& hit = hits[k];
+        if (k==0 || hit.PMT_id!=hits[k-1].PMT_id) {
+          if (k>0) hitIndex->Fill();
+          firstEntry = entry;
+          nEntries = 0;
+        }
+        nHits = 1; nPE = hit.nPE; dist = hit.dist; costh = hit.costh; costh_mPMT = hit.costh_mPMT;
+        cosths = hit.cosths; timetof = hit.timetof; time = hit.time; PMT_id = hit.PMT_id; mPMT_PMTNo = hit.mPMT_PMTNo; evt = hit.evt; source_id = hit.source_id;
+#ifdef USE_RNTUPLE
+        if (ntupleOutput) hitNTuple[pmtType]->Fill(hit);
+        else
+#endif
+        hitTree->Fill();
+        entry++;
+        nEntries++;
       }
-      double Norm = TMath::Sqrt(vDir[0]*vDir[0]+vDir[1]*vDir[1]+vDir[2]*vDir[2]);
-      double NormOrientation = TMath::Sqrt(vOrientation[0]*vOrientation[0]+vOrientation[1]*vOrientation[1]+vOrientation[2]*vOrientation[2]);
-      for(int j=0;j<3;j++){
-        vDir[j] /= Norm;
-        vOrientation[j] /= NormOrientation;
+      if (!hits.empty()) hitIndex->Fill();
+      hitIndex->Write();
+      std::vector<HitRecord>().swap(hits);
+    }
+  }
+#ifdef USE_RNTUPLE
+  for (int pmtType=0;pmtType<nPMTtypes;pmtType++) hitNTuple[pmtType].reset(); // commits the RNTuples to outfile
+#endif
+  if (!ntupleOutput) {
+    hitRate_pmtType0->Write("",TObject::kOverwrite);
+    hitRate_pmtType1->Write("",TObject::kOverwrite);
+  }
+  if (rawfile) {
+    rawfile->cd();
+    for (int pmtType=0;pmtType<nPMTtypes;pmtType++) rawHitRate[pmtType]->Write("",TObject::kOverwrite);
+    if (rawPhotons) cout << "Raw photon histograms go to " << rawfilename << endl;
+    else outfile->cd();
+  }
+  if (rawPhotons || aggregatefilename!=NULL) {
+    // Timetof histograms, x = PMT_id, y = timetof. Source 0 is hTimetof_pmtType*, other sources get a _source suffix.
+    // In aggregate mode the histograms already in the file are added and replaced.
+    cout << "Binned " << nPhotons << " PE, " << nPhotonsOutside << " outside [" << timetof_min << ", " << timetof_max << "] ns" << endl;
+    for (int pmtType=0;pmtType<nPMTtypes;pmtType++) {
+      for (size_t s=0;s<timetofCounts[pmtType].size();s++) {
+        std::string name = s==0 ? Form("hTimetof_pmtType%i",pmtType) : Form("hTimetof_pmtType%i_source%i",pmtType,(int)s);
+        std::vector<double>& counts = timetofCounts[pmtType][s];
+        TH2D* hPrevious = aggregatefilename!=NULL ? (TH2D*)outfile->Get(name.c_str()) : 0;
+        if (hPrevious) {
+          for (int i=0;i<nPMTs[pmtType];i++)
+            for (int k=0;k<nbins_timetof;k++)
+              counts[(size_t)i*nbins_timetof+k] += hPrevious->GetBinContent(i+1,k+1);
+          delete hPrevious;
+        }
+        TH2D* hTimetof = new TH2D(name.c_str(),(name+";PMT_id;timetof (ns)").c_str(),nPMTs[pmtType],0,nPMTs[pmtType],nbins_timetof,timetof_min,timetof_max);
+        double entries = 0;
+        for (int i=0;i<nPMTs[pmtType];i++) {
+          for (int k=0;k<nbins_timetof;k++) {
+            double n = counts[(size_t)i*nbins_timetof+k];
+            if (n==0) continue;
+            hTimetof->SetBinContent(i+1,k+1,n);
+            entries += n;
+          }
+        }
+        hTimetof->SetEntries(entries);
+        hTimetof->Write("",TObject::kOverwrite);
+        delete hTimetof;
+        std::vector<double>().swap(counts);
       }
-      dist = Norm;
-      costh = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
-      cosths = vDir[0]*vDirSource[0]+vDir[1]*vDirSource[1]+vDir[2]*vDirSource[2];
-      if (pmtType==0) pmt_type0->Fill();
-      if (pmtType==1) {
-          if(mPMT_PMTNo == 19) costh_mPMT = costh;
-          else{
-              pmt = geo->GetPMT(i-i%19+18,true);
-              for(int j=0;j<3;j++){
-                  PMTpos[j] = pmt.GetPosition(j);
-                  PMTdir[j] = pmt.GetOrientation(j);
-              }
-              for(int j=0;j<3;j++) particleRelativePMTpos[j] = PMTpos[j] - vtxpos[j];
-              for(int j=0;j<3;j++){
-                  vDir[j] = particleRelativePMTpos[j];
-                  vOrientation[j] = PMTdir[j];
-              }
-              Norm = TMath::Sqrt(vDir[0]*vDir[0]+vDir[1]*vDir[1]+vDir[2]*vDir[2]);
-              NormOrientation = TMath::Sqrt(vOrientation[0]*vOrientation[0]+vOrientation[1]*vOrientation[1]+vOrientation[2]*vOrientation[2]);
-              for(int j=0;j<3;j++){
-                  vDir[j] /= Norm;
-                  vOrientation[j] /= NormOrientation;
+    }
+  }
+  outfile->cd();
+  // Save the source positions
+  TTree* sources = new TTree("sources","sources");
+  sources->Branch("source_id",&source_id);
+  sources->Branch("vtx_x",&vtxpos[0]);
+  sources->Branch("vtx_y",&vtxpos[1]);
+  sources->Branch("vtx_z",&vtxpos[2]);
+  for (size_t s=0;s<sourcePos.size();s++) {
+    source_id = s;
+    for (int j=0;j<3;j++) vtxpos[j] = sourcePos[s][j];
+    sources->Fill();
+  }
+  sources->Write("",TObject::kOverwrite);
+
+  // The geometry tables are identified by the hash of their inputs. With -g they go to a sidecar file next to the
+  // output, which is only computed if no other output has written it yet
+  unsigned long long geoHash = GeometryHash(hybrid,sourcePos);
+  std::string geoHashString = Form("%016llx",geoHash);
+  TNamed("geometry_hash",geoHashString.c_str()).Write("",TObject::kOverwrite);
+  TFile* geofile = outfile;
+  std::string sidecar, sidecarTmp;
+  if (geometrySidecar) {
+    std::string outdir = outfilename;
+    size_t slash = outdir.find_last_of('/');
+    outdir = slash==std::string::npos ? "" : outdir.substr(0,slash+1);
+    sidecar = "geometry_"+geoHashString+".root";
+    TNamed("geometry_sidecar",sidecar.c_str()).Write("",TObject::kOverwrite);
+    if (std::ifstream((outdir+sidecar).c_str()).good()) {
+      cout << "Reusing geometry " << outdir+sidecar << endl;
+      geofile = 0;
+    } else {
+      // written under a temporary name and renamed, so that concurrent jobs never see a partial sidecar
+      sidecar = outdir+sidecar;
+      sidecarTmp = sidecar+Form(".tmp%i",(int)getpid());
+      geofile = new TFile(sidecarTmp.c_str(),"RECREATE");
+    }
+  }
+  if (geofile) {
+    geofile->cd();
+    // Save also PMT geometry information, one table per source ordered by source_id then PMT_id
+    TTree* pmt_type0 = new TTree("pmt_type0","pmt_type0");
+    pmt_type0->Branch("dist",&dist);
+    pmt_type0->Branch("costh",&costh);
+    pmt_type0->Branch("cosths",&cosths);
+    pmt_type0->Branch("PMT_id",&PMT_id);
+    pmt_type0->Branch("source_id",&source_id);
+    TTree* pmt_type1 = new TTree("pmt_type1","pmt_type1");
+    pmt_type1->Branch("dist",&dist);
+    pmt_type1->Branch("costh",&costh);
+    pmt_type1->Branch("costh_mPMT",&costh_mPMT);
+    pmt_type1->Branch("cosths",&cosths);
+    pmt_type1->Branch("PMT_id",&PMT_id);
+    pmt_type1->Branch("mPMT_PMTNo",&mPMT_PMTNo);
+    pmt_type1->Branch("source_id",&source_id);
+
+    int nPMTs_type0=geo->GetWCNumPMT();
+    int nPMTs_type1=0; if (hybrid) nPMTs_type1=geo->GetWCNumPMT(true);
+    for (size_t s=0;s<sourcePos.size();s++) {
+      source_id = s;
+      for (int j=0;j<3;j++) vtxpos[j] = sourcePos[s][j];
+      double vDirSource[3];
+      SourceDirection(vtxpos,vDirSource);
+      for (int pmtType=0;pmtType<nPMTtypes;pmtType++) {
+        int nPMTs_type = pmtType==0 ? nPMTs_type0 : nPMTs_type1;
+        for (int i=0;i<nPMTs_type;i++) {
+          WCSimRootPMT pmt;
+          if (pmtType==0) pmt = geo->GetPMT(i,false);
+          else pmt = geo->GetPMT(i,true);
+          if (pmtType == 0) PMT_id = i;
+          else {
+              PMT_id = i;
+              mPMT_PMTNo = pmt.GetmPMT_PMTNo();
+          }
+          double PMTpos[3];
+          double PMTdir[3];                   
+          for(int j=0;j<3;j++){
+            PMTpos[j] = pmt.GetPosition(j);
+            PMTdir[j] = pmt.GetOrientation(j);
+          }
+          double particleRelativePMTpos[3];
+          for(int j=0;j<3;j++) particleRelativePMTpos[j] = PMTpos[j] - vtxpos[j];
+          double vDir[3];double vOrientation[3];
+          for(int j=0;j<3;j++){
+            vDir[j] = particleRelativePMTpos[j];
+            vOrientation[j] = PMTdir[j];
+          }
+          double Norm = TMath::Sqrt(vDir[0]*vDir[0]+vDir[1]*vDir[1]+vDir[2]*vDir[2]);
+          double NormOrientation = TMath::Sqrt(vOrientation[0]*vOrientation[0]+vOrientation[1]*vOrientation[1]+vOrientation[2]*vOrientation[2]);
+          for(int j=0;j<3;j++){
+            vDir[j] /= Norm;
+            vOrientation[j] /= NormOrientation;
+          }
+          dist = Norm;
+          costh = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
+          cosths = vDir[0]*vDirSource[0]+vDir[1]*vDirSource[1]+vDir[2]*vDirSource[2];
+          if (pmtType==0) pmt_type0->Fill();
+          if (pmtType==1) {
+              if(mPMT_PMTNo == 19) costh_mPMT = costh;
+              else{
+                  pmt = geo->GetPMT(i-i%19+18,true);
+                  for(int j=0;j<3;j++){
+                      PMTpos[j] = pmt.GetPosition(j);
+                      PMTdir[j] = pmt.GetOrientation(j);
+                  }
+                  for(int j=0;j<3;j++) particleRelativePMTpos[j] = PMTpos[j] - vtxpos[j];
+                  for(int j=0;j<3;j++){
+                      vDir[j] = particleRelativePMTpos[j];
+                      vOrientation[j] = PMTdir[j];
+                  }
+                  Norm = TMath::Sqrt(vDir[0]*vDir[0]+vDir[1]*vDir[1]+vDir[2]*vDir[2]);
+                  NormOrientation = TMath::Sqrt(vOrientation[0]*vOrientation[0]+vOrientation[1]*vOrientation[1]+vOrientation[2]*vOrientation[2]);
+                  for(int j=0;j<3;j++){
+                      vDir[j] /= Norm;
+                      vOrientation[j] /= NormOrientation;
+                  }
+                  costh_mPMT = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
               }
-              costh_mPMT = vDir[0]*vOrientation[0]+vDir[1]*vOrientation[1]+vDir[2]*vOrientation[2];
+              pmt_type1->Fill();
           }
-          pmt_type1->Fill();
+        }
       }
     }
+    pmt_type0->Write("",TObject::kOverwrite);
+    pmt_type1->Write("",TObject::kOverwrite);
+    TNamed("geometry_hash",geoHashString.c_str()).Write("",TObject::kOverwrite);
+    if (geofile!=outfile) {
+      geofile->Close();
+      if (rename(sidecarTmp.c_str(),sidecar.c_str())!=0) cout << "Error, could not write " << sidecar << endl;
+      else cout << "Geometry written to " << sidecar << endl;
+    }
+  }
+  if (rawfile) {
+    // the raw hit file gets the same sources and geometry tables (or sidecar reference) as the output
+    rawfile->cd();
+    const char* trees[] = {"sources","pmt_type0","pmt_type1"};
+    for (const char* name : trees) {
+      TTree* t = (TTree*)outfile->Get(name);
+      if (t) t->CloneTree(-1)->Write("",TObject::kOverwrite);
+    }
+    const char* tags[] = {"geometry_hash","geometry_sidecar"};
+    for (const char* name : tags) {
+      TObject* tag = outfile->Get(name);
+      if (tag) tag->Write(name,TObject::kOverwrite);
+    }
+    rawfile->Close();
+  }
+  if (aggregatefilename!=NULL) {
+    // recorded in the same file as the hits, so that an interrupted run cannot add them without recording the input
+    manifestText += Form("%lld %llx %s\n",inputSize,inputHash,filename);
+    outfile->cd();
+    TNamed("manifest",manifestText.c_str()).Write("",TObject::kOverwrite);
   }
-  pmt_type0->Write();
-  pmt_type1->Write();
   outfile->Close();
+
+  if (aggregatefilename!=NULL) {
+    std::ofstream out(manifest.c_str());
+    out << manifestText;
+    cout << "Added " << filename << " to " << manifest << endl;
+  }
   
   return 0;
  }
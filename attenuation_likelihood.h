@@ -0,0 +1,330 @@
+// Likelihood kernel of the attenuation fit, shared by fit_water_attenuation.c and bench_likelihood.cc.
+// Only depends on the standard library, so it can be benchmarked without ROOT inputs.
+#ifndef ATTENUATION_LIKELIHOOD_H
+#define ATTENUATION_LIKELIHOOD_H
+
+#include <cmath>
+#include <algorithm>
+#include <vector>
+#include <thread>
+#include <atomic>
+#include <functional>
+
+inline double PoissonLLH (double mc, double w2, double data)
+{
+
+        // Standard Poisson LLH.
+        double chi2 = 0.0;
+        if(mc > 0.0)
+        {
+            chi2 = 2 * (mc - data);
+            if(data > 0.0)
+                chi2 += 2 * data * std::log(data / mc);
+        }
+
+        return (chi2 >= 0.0) ? chi2 : 0.0;
+
+}
+
+// Run task(i, thread) for i in [0,n) on a pool of nthreads threads
+inline void run_parallel(int n, int nthreads, std::function<void(int,int)> task)
+{
+    if (nthreads<=1) {
+        for (int i=0;i<n;i++) task(i,0);
+        return;
+    }
+    std::atomic<int> next(0);
+    std::vector<std::thread> pool;
+    for (int t=0;t<nthreads;t++) {
+        pool.emplace_back([&,t]() {
+            for (int i=next++;i<n;i=next++) task(i,t);
+        });
+    }
+    for (size_t t=0;t<pool.size();t++) pool[t].join();
+}
+
+// Per-channel arrays the likelihood is evaluated on. These are plain views, so they can point into a
+// ChannelGeometry or into a memory-mapped fit input file.
+struct ChannelView {
+    int nPMT, nmPMT;
+    const double* PMT_R;
+    const double* PMT_costh;
+    const char* PMT_use;
+    const double* mPMT_R;
+    const double* mPMT_costh;
+    const double* mPMT_costh_mPMT;
+    const char* mPMT_use;
+};
+
+// Angular binning of the normalization parameters and the channel types in the fit. With useNormB = false the
+// non-PMT angular parameters B are fixed to 1 and left out of the model.
+struct LikelihoodConfig {
+    int nCosthBins;
+    double costh_min, costh_max;
+    bool usemPMT, usePMT;
+    bool useNormB = true;
+
+    // same as TAxis::FindBin for fixed bins: 0 = underflow, nCosthBins+1 = overflow
+    int FindBin(double costh) const {
+        if (costh < costh_min) return 0;
+        if (costh >= costh_max) return nCosthBins+1;
+        return 1 + int(nCosthBins*(costh-costh_min)/(costh_max-costh_min));
+    }
+};
+
+// Likelihood of the attenuation model for the channels g of one source with per-channel rates rate0 (B&L) and
+// rate1 (mPMT), scaled by the source intensity norm. Only reads its inputs, so several fits or sources can be
+// evaluated concurrently.
+// par[0] = alpha, par[1..n] = mPMT angular norms, par[n+1..2n] = B&L angular norms, par[2n+1..3n] = B
+// The channel types and the B term are template parameters, so that each configuration compiles to a loop without
+// branches on them; SelectLikelihood picks the instantiation once for a configuration.
+template <bool UsemPMT, bool UsePMT, bool UseNormB>
+double AttenuationLikelihoodT(const double* par, const LikelihoodConfig& cfg, const ChannelView& g,
+                              const double* rate0, const double* rate1, double norm = 1)
+{
+    const int nCosthBins = cfg.nCosthBins;
+    const double* norm3 = par;
+    const double* norm20 = par+nCosthBins;
+    const double* normB = par+2*nCosthBins;
+
+    for(int i=1; i<=nCosthBins; i++){
+        if(UsemPMT && norm3[i]<0) return 1e20;
+        if(UsePMT && norm20[i]<0) return 1e20;
+    }
+
+    double chi2_stat = 0;
+
+    if(UsemPMT) {
+        for (int i = 0; i < g.nmPMT; i++) {
+            if (!g.mPMT_use[i]) continue;
+            double value = std::exp(-g.mPMT_R[i] / par[0]) / g.mPMT_R[i] / g.mPMT_R[i] * 9000 * 9000 * norm; //an arbitrary normalization
+            int costh_idx = cfg.FindBin(g.mPMT_costh[i]);
+            int costh_mPMT_idx = cfg.FindBin(g.mPMT_costh_mPMT[i]);
+            if (costh_idx >= 1 && costh_idx <= nCosthBins &&
+                costh_mPMT_idx >= 1 && costh_mPMT_idx <= nCosthBins) {
+                value *= norm3[costh_idx];
+                if (UseNormB) value *= normB[costh_mPMT_idx];
+                chi2_stat += PoissonLLH(value, 0, rate1[i]);
+            }
+        }
+
+    }
+    if(UsePMT) {
+        for (int i = 0; i < g.nPMT; i++) {
+            if (!g.PMT_use[i]) continue;
+            double value =
+                    std::exp(-g.PMT_R[i] / par[0]) / g.PMT_R[i] / g.PMT_R[i] * 9000 * 9000 * norm; //an arbitrary normalization
+            int costh_idx = cfg.FindBin(g.PMT_costh[i]);
+            if (costh_idx >= 1 && costh_idx <= nCosthBins) {
+                value *= norm20[costh_idx];
+                if (UseNormB) value *= normB[costh_idx];
+                chi2_stat += PoissonLLH(value, 0, rate0[i]);
+            }
+        }
+
+    }
+
+    return chi2_stat;
+}
+
+typedef double (*LikelihoodKernel)(const double*, const LikelihoodConfig&, const ChannelView&,
+                                   const double*, const double*, double);
+
+// Instantiation of AttenuationLikelihoodT for the channel types and B term of cfg
+inline LikelihoodKernel SelectLikelihood(const LikelihoodConfig& cfg)
+{
+    if (cfg.useNormB) {
+        if (cfg.usemPMT && cfg.usePMT) return &AttenuationLikelihoodT<true,true,true>;
+        if (cfg.usemPMT) return &AttenuationLikelihoodT<true,false,true>;
+        if (cfg.usePMT) return &AttenuationLikelihoodT<false,true,true>;
+        return &AttenuationLikelihoodT<false,false,true>;
+    }
+    if (cfg.usemPMT && cfg.usePMT) return &AttenuationLikelihoodT<true,true,false>;
+    if (cfg.usemPMT) return &AttenuationLikelihoodT<true,false,false>;
+    if (cfg.usePMT) return &AttenuationLikelihoodT<false,true,false>;
+    return &AttenuationLikelihoodT<false,false,false>;
+}
+
+// Likelihood for any configuration, dispatching on cfg at every call
+inline double AttenuationLikelihood(const double* par, const LikelihoodConfig& cfg, const ChannelView& g,
+                                    const double* rate0, const double* rate1, double norm = 1)
+{
+    return SelectLikelihood(cfg)(par, cfg, g, rate0, rate1, norm);
+}
+
+// Compensated (Kahan) summation
+struct KahanSum {
+    double sum, c;
+    KahanSum() : sum(0), c(0) {}
+    void Add(double x) {
+        double y = x-c;
+        double t = sum+y;
+        c = (t-sum)-y;
+        sum = t;
+    }
+};
+
+// PoissonLLH in single precision, written as 2d(u-log(1+u)) with u = mu/d-1. For small u the series is used, so the
+// term keeps its relative precision when mu is close to d instead of cancelling between 2(mu-d) and 2d log(d/mu).
+inline float PoissonLLHFloat(float mu, float data)
+{
+    if (mu <= 0) return 0;
+    if (data <= 0) return 2*mu;
+    float u = mu/data-1;
+    float f;
+    if (std::fabs(u) < 0.05f) f = u*u*(0.5f-u*(1.f/3-u*(0.25f-u*(0.2f-u*(1.f/6)))));
+    else f = u-std::log1p(u);
+    return 2*data*f;
+}
+
+// Single precision copy of the channels in use with their parameter indices resolved, for the mixed precision
+// evaluation. B&L and mPMT channels are stored together, channels outside the costh range are dropped.
+struct CompactChannels {
+    std::vector<float> R;
+    std::vector<float> data;
+    std::vector<int> par1, par2; // indices of the two angular parameters
+
+    void Build(const LikelihoodConfig& cfg, const ChannelView& g, const double* rate0, const double* rate1) {
+        int nCosthBins = cfg.nCosthBins;
+        R.clear(); data.clear(); par1.clear(); par2.clear();
+        if (cfg.usemPMT) {
+            for (int i = 0; i < g.nmPMT; i++) {
+                if (!g.mPMT_use[i]) continue;
+                int costh_idx = cfg.FindBin(g.mPMT_costh[i]);
+                int costh_mPMT_idx = cfg.FindBin(g.mPMT_costh_mPMT[i]);
+                if (costh_idx < 1 || costh_idx > nCosthBins || costh_mPMT_idx < 1 || costh_mPMT_idx > nCosthBins) continue;
+                R.push_back(g.mPMT_R[i]);
+                data.push_back(rate1[i]);
+                par1.push_back(costh_idx);
+                par2.push_back(costh_mPMT_idx + 2*nCosthBins);
+            }
+        }
+        if (cfg.usePMT) {
+            for (int i = 0; i < g.nPMT; i++) {
+                if (!g.PMT_use[i]) continue;
+                int costh_idx = cfg.FindBin(g.PMT_costh[i]);
+                if (costh_idx < 1 || costh_idx > nCosthBins) continue;
+                R.push_back(g.PMT_R[i]);
+                data.push_back(rate0[i]);
+                par1.push_back(costh_idx + nCosthBins);
+                par2.push_back(costh_idx + 2*nCosthBins);
+            }
+        }
+    }
+};
+
+// AttenuationLikelihood evaluated per channel in single precision. The terms are summed with Kahan summation in
+// blocks of 256 channels and the block sums with Kahan summation in double precision.
+inline double AttenuationLikelihoodFloat(const double* par, int nCosthBins, const CompactChannels& ch, double norm = 1)
+{
+    for(int i=1; i<=nCosthBins; i++){
+        if(par[i]<0) return 1e20;
+        if(par[i+nCosthBins]<0) return 1e20;
+    }
+
+    const int block = 256;
+    float inv_alpha = 1./par[0];
+    float scale = 9000.*9000.*norm; //an arbitrary normalization
+    int n = ch.R.size();
+    KahanSum total;
+    for (int first = 0; first < n; first += block) {
+        int last = std::min(n, first+block);
+        float sum = 0, c = 0;
+        for (int i = first; i < last; i++) {
+            float R = ch.R[i];
+            float mu = std::exp(-R*inv_alpha)/(R*R)*scale*(float)par[ch.par1[i]]*(float)par[ch.par2[i]];
+            float y = PoissonLLHFloat(mu, ch.data[i])-c;
+            float t = sum+y;
+            c = (t-sum)-y;
+            sum = t;
+        }
+        total.Add(sum);
+    }
+
+    return total.sum;
+}
+
+// Value, gradient and optionally Hessian (npar x npar, row major) of AttenuationLikelihood, which are added to grad
+// and hess. The Poisson term of a channel has d(chi2)/d(mu) = 2(1-d/mu) and d2(chi2)/d(mu)2 = 2d/mu^2, and mu only
+// depends on alpha and on two or three multiplicative parameters, so each channel updates at most 4x4 entries.
+// With norm_index >= 0 the source intensity is the parameter par[norm_index] instead of the constant norm.
+// Channels with mu = 0 contribute nothing, as in PoissonLLH, instead of infinite d/mu terms.
+inline double AttenuationDerivatives(const double* par, const LikelihoodConfig& cfg, const ChannelView& g,
+                                     const double* rate0, const double* rate1,
+                                     int npar, double* grad, double* hess, double norm = 1, int norm_index = -1)
+{
+    int nCosthBins = cfg.nCosthBins;
+
+    for(int i=1; i<=nCosthBins; i++){
+        if(par[i]<0) return 1e20;
+        if(par[i+nCosthBins]<0) return 1e20;
+    }
+
+    double alpha = par[0];
+    double chi2_stat = 0;
+    // parameters of the channel: idx[0] is alpha, idx[1..nmult] are the multiplicative parameters
+    int idx[4] = {0, 0, 0, norm_index};
+    int nmult = norm_index>=0 ? 3 : 2;
+    auto add_channel = [&](double R, double data) {
+        double p[3] = {par[idx[1]], par[idx[2]], norm_index>=0 ? par[norm_index] : 1.};
+        double base = std::exp(-R / alpha) / R / R * 9000 * 9000 * (norm_index>=0 ? 1. : norm);
+        double mu = base*p[0]*p[1]*p[2];
+        if (!(mu > 0)) return;
+        chi2_stat += PoissonLLH(mu, 0, data);
+        double c1 = 2*(1-data/mu);
+        double c2 = 2*data/(mu*mu);
+        double dalpha = R/(alpha*alpha); // d(ln mu)/d(alpha)
+        // first derivatives of mu, products taken without the parameter itself so that zero parameters are safe
+        double d1[4];
+        d1[0] = mu*dalpha;
+        for (int k=0;k<nmult;k++) {
+            d1[k+1] = base;
+            for (int j=0;j<3;j++) if (j!=k) d1[k+1] *= p[j];
+        }
+        for (int k=0;k<=nmult;k++) grad[idx[k]] += c1*d1[k];
+        if (!hess) return;
+        for (int k=0;k<=nmult;k++) {
+            for (int l=0;l<=nmult;l++) {
+                double d2;
+                if (k==0 && l==0) d2 = mu*(dalpha*dalpha-2*R/(alpha*alpha*alpha));
+                else if (k==0) d2 = d1[l]*dalpha;
+                else if (l==0) d2 = d1[k]*dalpha;
+                else if (k==l) d2 = 0;
+                else {
+                    d2 = base;
+                    for (int j=0;j<3;j++) if (j!=k-1 && j!=l-1) d2 *= p[j];
+                }
+                hess[idx[k]*npar+idx[l]] += c2*d1[k]*d1[l] + c1*d2;
+            }
+        }
+    };
+
+    if(cfg.usemPMT) {
+        for (int i = 0; i < g.nmPMT; i++) {
+            if (!g.mPMT_use[i]) continue;
+            int costh_idx = cfg.FindBin(g.mPMT_costh[i]);
+            int costh_mPMT_idx = cfg.FindBin(g.mPMT_costh_mPMT[i]);
+            if (costh_idx >= 1 && costh_idx <= nCosthBins &&
+                costh_mPMT_idx >= 1 && costh_mPMT_idx <= nCosthBins) {
+                idx[1] = costh_idx;
+                idx[2] = costh_mPMT_idx + 2*nCosthBins;
+                add_channel(g.mPMT_R[i], rate1[i]);
+            }
+        }
+    }
+    if(cfg.usePMT) {
+        for (int i = 0; i < g.nPMT; i++) {
+            if (!g.PMT_use[i]) continue;
+            int costh_idx = cfg.FindBin(g.PMT_costh[i]);
+            if (costh_idx >= 1 && costh_idx <= nCosthBins) {
+                idx[1] = costh_idx + nCosthBins;
+                idx[2] = costh_idx + 2*nCosthBins;
+                add_channel(g.PMT_R[i], rate0[i]);
+            }
+        }
+    }
+
+    return chi2_stat;
+}
+
+#endif
@@ -0,0 +1,245 @@
+// Throughput benchmark of the attenuation likelihood kernel on synthetic geometry and rates.
+// Reports likelihood and gradient evaluations per second, ns per channel and the scaling across threads as JSON.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <random>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include "attenuation_likelihood.h"
+
+using namespace std;
+
+// Channels of a synthetic cylindrical detector seen from a diffuser on the barrel wall
+struct SyntheticChannels {
+  std::vector<double> PMT_R, PMT_costh, mPMT_R, mPMT_costh, mPMT_costh_mPMT;
+  std::vector<char> PMT_use, mPMT_use;
+  std::vector<double> rate0, rate1;
+
+  ChannelView view(int first0, int n0, int first1, int n1) const {
+    ChannelView v = {n0, n1,
+                     PMT_R.data()+first0, PMT_costh.data()+first0, PMT_use.data()+first0,
+                     mPMT_R.data()+first1, mPMT_costh.data()+first1, mPMT_costh_mPMT.data()+first1, mPMT_use.data()+first1};
+    return v;
+  }
+};
+
+// Distances and angles are drawn to cover the ranges of a full size detector (R in [1000, 7000] cm, costh in [0.5, 1]),
+// and the rates are Poisson fluctuations of the model at par
+void Synthesize(SyntheticChannels& ch, int nPMT, int nmPMT, const LikelihoodConfig& cfg, const std::vector<double>& par, unsigned int seed) {
+  std::mt19937 rng(seed);
+  std::uniform_real_distribution<double> uR(1000,7000), uCosth(0.5,1), uUse(0,1);
+  auto fill = [&](int n, std::vector<double>& R, std::vector<double>& costh, std::vector<double>* costh_mPMT, std::vector<char>& use) {
+    R.resize(n); costh.resize(n); use.resize(n);
+    if (costh_mPMT) costh_mPMT->resize(n);
+    for (int i=0;i<n;i++) {
+      R[i] = uR(rng);
+      costh[i] = uCosth(rng);
+      if (costh_mPMT) (*costh_mPMT)[i] = uCosth(rng);
+      use[i] = uUse(rng)<0.9; // about the fraction within the source opening angle
+    }
+  };
+  fill(nPMT,ch.PMT_R,ch.PMT_costh,0,ch.PMT_use);
+  fill(nmPMT,ch.mPMT_R,ch.mPMT_costh,&ch.mPMT_costh_mPMT,ch.mPMT_use);
+
+  int n = cfg.nCosthBins;
+  ch.rate0.assign(nPMT,0);
+  ch.rate1.assign(nmPMT,0);
+  for (int i=0;i<nPMT;i++) {
+    int bin = cfg.FindBin(ch.PMT_costh[i]);
+    double mu = std::exp(-ch.PMT_R[i]/par[0])/ch.PMT_R[i]/ch.PMT_R[i]*9000*9000*par[bin+n]*par[bin+2*n];
+    ch.rate0[i] = std::poisson_distribution<int>(mu)(rng);
+  }
+  for (int i=0;i<nmPMT;i++) {
+    int bin = cfg.FindBin(ch.mPMT_costh[i]);
+    int bin_mPMT = cfg.FindBin(ch.mPMT_costh_mPMT[i]);
+    double mu = std::exp(-ch.mPMT_R[i]/par[0])/ch.mPMT_R[i]/ch.mPMT_R[i]*9000*9000*par[bin]*par[bin_mPMT+2*n];
+    ch.rate1[i] = std::poisson_distribution<int>(mu)(rng);
+  }
+}
+
+// Call f repeatedly for at least min_seconds and return the number of calls per second
+double CallsPerSecond(std::function<void()> f, double min_seconds) {
+  f(); // warm up
+  long calls = 0;
+  auto start = std::chrono::steady_clock::now();
+  double elapsed = 0;
+  while (elapsed<min_seconds) {
+    for (int i=0;i<10;i++) f();
+    calls += 10;
+    elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  }
+  return calls/elapsed;
+}
+
+std::string GitCommit() {
+  std::string commit;
+  FILE* pipe = popen("git rev-parse --short HEAD 2>/dev/null","r");
+  if (!pipe) return commit;
+  char buffer[64];
+  if (fgets(buffer,sizeof(buffer),pipe)) commit = buffer;
+  pclose(pipe);
+  while (!commit.empty() && (commit.back()=='\n' || commit.back()=='\r')) commit.pop_back();
+  return commit;
+}
+
+int main(int argc, char **argv){
+
+  int nPMT = 20000; // B&L PMTs of the full HK ID
+  int nmPMT = 800*19; // mPMT channels
+  int nbins_costh = 50;
+  int maxThreads = std::thread::hardware_concurrency();
+  double minSeconds = 1;
+  unsigned int seed = 12345;
+  char * outfilename=NULL;
+  char c;
+  while( (c = getopt(argc,argv,"n:m:c:t:s:r:o:")) != -1 ){
+    switch(c){
+      case 'n':
+        nPMT = std::stoi(optarg);
+        break;
+      case 'm':
+        nmPMT = std::stoi(optarg);
+        break;
+      case 'c':
+        nbins_costh = std::stoi(optarg);
+        break;
+      case 't':
+        maxThreads = std::stoi(optarg);
+        break;
+      case 's':
+        minSeconds = std::stod(optarg);
+        break;
+      case 'r':
+        seed = std::stoul(optarg);
+        break;
+      case 'o':
+        outfilename = optarg;
+        break;
+      default:
+        cout << "Usage: bench_likelihood [-n nPMT] [-m nmPMT] [-c nbins_costh] [-t max threads] [-s seconds per measurement] [-r seed] [-o output.json]" << endl;
+        return 0;
+    }
+  }
+  if (maxThreads<1) maxThreads = 1;
+
+  LikelihoodConfig cfg = {nbins_costh, 0.5, 1., true, true};
+  int npar = 3*nbins_costh+1;
+  std::vector<double> par(npar,1.);
+  par[0] = 8000; // alpha in cm
+
+  SyntheticChannels ch;
+  Synthesize(ch,nPMT,nmPMT,cfg,par,seed);
+  int nChannels = nPMT+nmPMT;
+  cout << "Synthesized " << nPMT << " B&L and " << nmPMT << " mPMT channels, " << nbins_costh << " costh bins" << endl;
+
+  // evaluate slightly away from the generated point so that no term is trivially zero
+  std::vector<double> eval_par(par);
+  eval_par[0] *= 1.05;
+  ChannelView all = ch.view(0,nPMT,0,nmPMT);
+  volatile double sink = 0;
+
+  double llhRate = CallsPerSecond([&]() {
+    sink = AttenuationLikelihood(eval_par.data(),cfg,all,ch.rate0.data(),ch.rate1.data());
+  }, minSeconds);
+  std::vector<double> grad(npar);
+  double gradRate = CallsPerSecond([&]() {
+    std::fill(grad.begin(),grad.end(),0.);
+    sink = AttenuationDerivatives(eval_par.data(),cfg,all,ch.rate0.data(),ch.rate1.data(),npar,grad.data(),0);
+  }, minSeconds);
+  CompactChannels compact;
+  compact.Build(cfg,all,ch.rate0.data(),ch.rate1.data());
+  double floatRate = CallsPerSecond([&]() {
+    sink = AttenuationLikelihoodFloat(eval_par.data(),cfg.nCosthBins,compact);
+  }, minSeconds);
+  double llhDouble = AttenuationLikelihood(eval_par.data(),cfg,all,ch.rate0.data(),ch.rate1.data());
+  double llhFloat = AttenuationLikelihoodFloat(eval_par.data(),cfg.nCosthBins,compact);
+  cout << "Likelihood: " << llhRate << " evaluations/s, " << 1e9/llhRate/nChannels << " ns/channel" << endl;
+  cout << "Likelihood (float): " << floatRate << " evaluations/s, " << 1e9/floatRate/nChannels << " ns/channel, relative difference "
+       << (llhFloat-llhDouble)/llhDouble << endl;
+  cout << "Gradient: " << gradRate << " evaluations/s, " << 1e9/gradRate/nChannels << " ns/channel" << endl;
+
+  // Likelihood instantiations of the detector configurations, selected once as in the fit
+  struct Variant { const char* name; bool usemPMT, usePMT; int nChannels; };
+  std::vector<Variant> variants = {{"hybrid",true,true,nChannels}, {"mPMT_only",true,false,nmPMT}, {"BL_only",false,true,nPMT}};
+  std::vector<double> variantRates;
+  for (size_t v=0;v<variants.size();v++) {
+    LikelihoodConfig vcfg = cfg;
+    vcfg.usemPMT = variants[v].usemPMT;
+    vcfg.usePMT = variants[v].usePMT;
+    LikelihoodKernel kernel = SelectLikelihood(vcfg);
+    double rate = CallsPerSecond([&]() {
+      sink = kernel(eval_par.data(),vcfg,all,ch.rate0.data(),ch.rate1.data(),1.);
+    }, minSeconds);
+    variantRates.push_back(rate);
+    cout << "Likelihood (" << variants[v].name << "): " << rate << " evaluations/s, "
+         << 1e9/rate/std::max(1,variants[v].nChannels) << " ns/channel" << endl;
+  }
+
+  // Thread scaling: the channels are split into contiguous chunks, one per thread, summed in a fixed order
+  std::vector<int> threadCounts;
+  for (int t=1;t<maxThreads;t*=2) threadCounts.push_back(t);
+  threadCounts.push_back(maxThreads);
+  std::vector<double> threadRates;
+  for (size_t k=0;k<threadCounts.size();k++) {
+    int nthreads = threadCounts[k];
+    std::vector<ChannelView> chunks;
+    for (int t=0;t<nthreads;t++) {
+      int first0 = (long)nPMT*t/nthreads, last0 = (long)nPMT*(t+1)/nthreads;
+      int first1 = (long)nmPMT*t/nthreads, last1 = (long)nmPMT*(t+1)/nthreads;
+      chunks.push_back(ch.view(first0,last0-first0,first1,last1-first1));
+    }
+    std::vector<double> chi2(nthreads);
+    double rate = CallsPerSecond([&]() {
+      run_parallel(nthreads,nthreads,[&](int i, int t) {
+        ChannelView& v = chunks[i];
+        chi2[i] = AttenuationLikelihood(eval_par.data(),cfg,v,ch.rate0.data()+(v.PMT_R-ch.PMT_R.data()),
+                                        ch.rate1.data()+(v.mPMT_R-ch.mPMT_R.data()));
+      });
+      double sum = 0;
+      for (int i=0;i<nthreads;i++) sum += chi2[i];
+      sink = sum;
+    }, minSeconds);
+    threadRates.push_back(rate);
+    cout << nthreads << " threads: " << rate << " evaluations/s, speedup " << rate/threadRates[0] << endl;
+  }
+
+  std::ostringstream json;
+  json << "{\n";
+  json << "  \"commit\": \"" << GitCommit() << "\",\n";
+  json << "  \"nPMT\": " << nPMT << ",\n";
+  json << "  \"nmPMT\": " << nmPMT << ",\n";
+  json << "  \"nbins_costh\": " << nbins_costh << ",\n";
+  json << "  \"likelihood_evals_per_s\": " << llhRate << ",\n";
+  json << "  \"likelihood_ns_per_channel\": " << 1e9/llhRate/nChannels << ",\n";
+  json << "  \"likelihood_float_evals_per_s\": " << floatRate << ",\n";
+  json << "  \"likelihood_float_ns_per_channel\": " << 1e9/floatRate/nChannels << ",\n";
+  json << "  \"likelihood_float_relative_difference\": " << (llhFloat-llhDouble)/llhDouble << ",\n";
+  json << "  \"gradient_evals_per_s\": " << gradRate << ",\n";
+  json << "  \"gradient_ns_per_channel\": " << 1e9/gradRate/nChannels << ",\n";
+  json << "  \"variants\": [";
+  for (size_t v=0;v<variants.size();v++) {
+    json << (v ? ", " : "") << "{\"config\": \"" << variants[v].name << "\", \"evals_per_s\": " << variantRates[v]
+         << ", \"ns_per_channel\": " << 1e9/variantRates[v]/std::max(1,variants[v].nChannels) << "}";
+  }
+  json << "],\n";
+  json << "  \"threads\": [";
+  for (size_t k=0;k<threadCounts.size();k++) {
+    json << (k ? ", " : "") << "{\"threads\": " << threadCounts[k] << ", \"evals_per_s\": " << threadRates[k]
+         << ", \"speedup\": " << threadRates[k]/threadRates[0] << "}";
+  }
+  json << "]\n}\n";
+
+  if (outfilename==NULL) cout << json.str();
+  else {
+    std::ofstream out(outfilename);
+    out << json.str();
+    cout << "Results written to " << outfilename << endl;
+  }
+
+  return 0;
+}
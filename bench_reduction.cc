@@ -0,0 +1,167 @@
+// Throughput benchmark of analysis_absorption on a synthetic WCSim file from make_synthetic_wcsim.
+// Runs the reduction in digitized, raw, raw photon, single pass digitized+raw and pipelined mode (and with RNTuple output if requested) and reports events/s,
+// hits/s, MB/s, output size and peak memory as JSON.
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <algorithm>
+#include <string>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+
+using namespace std;
+
+struct RunStats {
+  bool ok;
+  double seconds;
+  double maxRSS_MB;
+};
+
+// Run a command without a shell and measure its wall time and peak resident memory
+RunStats Run(const std::vector<std::string>& args) {
+  RunStats stats = {false,0,0};
+  std::vector<char*> argv;
+  for (size_t i=0;i<args.size();i++) argv.push_back(const_cast<char*>(args[i].c_str()));
+  argv.push_back(NULL);
+  auto start = std::chrono::steady_clock::now();
+  pid_t pid = fork();
+  if (pid<0) return stats;
+  if (pid==0) {
+    // keep the benchmark output readable
+    if (!freopen("/dev/null","w",stdout)) _exit(127);
+    execv(argv[0],argv.data());
+    _exit(127);
+  }
+  int status;
+  struct rusage usage;
+  if (wait4(pid,&status,0,&usage)<0) return stats;
+  stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now()-start).count();
+  stats.maxRSS_MB = usage.ru_maxrss/1024.; // ru_maxrss is in kB on Linux
+  stats.ok = WIFEXITED(status) && WEXITSTATUS(status)==0;
+  return stats;
+}
+
+int main(int argc, char **argv){
+
+  int nevent = 100;
+  int nPMT = 20000;
+  int nmPMT = 800;
+  int hitsPerEvent = 2000;
+  bool hybrid = true;
+  bool keepFiles = false;
+  bool ntuple = false;
+  std::string workdir = ".";
+  char * outfilename=NULL;
+  char c;
+  while( (c = getopt(argc,argv,"n:b:m:p:w:o:hkN")) != -1 ){
+    switch(c){
+      case 'n':
+        nevent = std::stoi(optarg);
+        break;
+      case 'b':
+        nPMT = std::stoi(optarg);
+        break;
+      case 'm':
+        nmPMT = std::stoi(optarg);
+        break;
+      case 'p':
+        hitsPerEvent = std::stoi(optarg);
+        break;
+      case 'w':
+        workdir = optarg;
+        break;
+      case 'o':
+        outfilename = optarg;
+        break;
+      case 'h':
+        hybrid = false;
+        break;
+      case 'k':
+        keepFiles = true;
+        break;
+      case 'N':
+        ntuple = true; // analysis_absorption built with RNTUPLE=1
+        break;
+      default:
+        cout << "Usage: bench_reduction [-n events] [-b B&L PMTs] [-m mPMT modules] [-p hits per event] [-h] [-w work directory] [-k] [-N] [-o output.json]" << endl;
+        return 0;
+    }
+  }
+
+  std::string input = workdir+"/bench_reduction_input.root";
+  std::string output = workdir+"/bench_reduction_output.root";
+  std::string rawOutput = workdir+"/bench_reduction_raw.root";
+  std::vector<std::string> generate = {"./make_synthetic_wcsim","-o",input,"-n",std::to_string(nevent),"-b",std::to_string(nPMT),
+                                       "-m",std::to_string(nmPMT),"-p",std::to_string(hitsPerEvent)};
+  if (!hybrid) generate.push_back("-h");
+  cout << "Generating " << nevent << " synthetic events" << endl;
+  RunStats genStats = Run(generate);
+  if (!genStats.ok) {
+    cout << "Error, could not generate " << input << endl;
+    return -1;
+  }
+  struct stat st;
+  double inputMB = stat(input.c_str(),&st)==0 ? st.st_size/1024./1024. : 0;
+  long nHits = (long)nevent*hitsPerEvent*(hybrid ? 2 : 1);
+
+  struct Mode { std::string name; std::vector<std::string> flags; };
+  std::vector<Mode> modes = {{"digitized",{}}, {"raw",{"-d"}}, {"raw_photons",{"-r"}}, {"digitized_and_raw",{"-R",rawOutput}},
+                             {"digitized_pipelined",{"-q","4"}}, {"raw_pipelined",{"-d","-q","4"}}};
+  if (ntuple) {
+    modes.push_back({"digitized_rntuple",{"-n"}});
+    modes.push_back({"raw_rntuple",{"-d","-n"}});
+  }
+  std::ostringstream json;
+  json << "{\n";
+  json << "  \"events\": " << nevent << ",\n";
+  json << "  \"nPMT\": " << nPMT << ",\n";
+  json << "  \"nmPMT_modules\": " << (hybrid ? nmPMT : 0) << ",\n";
+  json << "  \"hits\": " << nHits << ",\n";
+  json << "  \"input_MB\": " << inputMB << ",\n";
+  json << "  \"modes\": [";
+  bool ok = true;
+  int nReported = 0;
+  for (size_t m=0;m<modes.size();m++) {
+    std::vector<std::string> reduce = {"./analysis_absorption","-f",input,"-o",output};
+    if (!hybrid) reduce.push_back("-h");
+    reduce.insert(reduce.end(),modes[m].flags.begin(),modes[m].flags.end());
+    RunStats stats = Run(reduce);
+    if (!stats.ok) {
+      cout << modes[m].name << ": reduction failed" << endl;
+      ok = false;
+      continue;
+    }
+    double outputMB = stat(output.c_str(),&st)==0 ? st.st_size/1024./1024. : 0;
+    // -R writes the raw hits to a second file, count both outputs of the single pass
+    if (std::find(modes[m].flags.begin(),modes[m].flags.end(),"-R")!=modes[m].flags.end() && stat(rawOutput.c_str(),&st)==0)
+      outputMB += st.st_size/1024./1024.;
+    cout << modes[m].name << ": " << nevent/stats.seconds << " events/s, " << nHits/stats.seconds << " hits/s, "
+         << inputMB/stats.seconds << " MB/s, output " << outputMB << " MB, peak memory " << stats.maxRSS_MB << " MB" << endl;
+    json << (nReported++ ? ", " : "") << "\n    {\"mode\": \"" << modes[m].name << "\", \"seconds\": " << stats.seconds
+         << ", \"events_per_s\": " << nevent/stats.seconds << ", \"hits_per_s\": " << nHits/stats.seconds
+         << ", \"MB_per_s\": " << inputMB/stats.seconds << ", \"output_MB\": " << outputMB << ", \"peak_memory_MB\": " << stats.maxRSS_MB << "}";
+  }
+  json << "\n  ]\n}\n";
+
+  if (!keepFiles) {
+    remove(input.c_str());
+    remove(output.c_str());
+    remove(rawOutput.c_str());
+  }
+
+  if (outfilename==NULL) cout << json.str();
+  else {
+    std::ofstream out(outfilename);
+    out << json.str();
+    cout << "Results written to " << outfilename << endl;
+  }
+
+  return ok ? 0 : 1;
+}
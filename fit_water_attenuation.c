@@ -6,12 +6,46 @@
 #include "TFile.h"
 #include "TTree.h"
 #include "TChain.h"
+#include "TKey.h"
+#include "RVersion.h"
 #include "TCanvas.h"
 #include "TStyle.h"
+#include "TRandom3.h"
+#include "TMatrixDSym.h"
+#include "TSystem.h"
 #include "Math/Minimizer.h"
 #include "Math/Factory.h"
 #include "Math/Functor.h"
+#include "Math/IFunction.h"
 #include <iostream>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <map>
+#include <limits>
+#include <set>
+#include <ctime>
+#include <thread>
+#include <chrono>
+#include <atomic>
+#include <functional>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <dirent.h>
+#include <glob.h>
+#include "attenuation_likelihood.h"
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,34,0)
+#define HAVE_RNTUPLE
+#include <ROOT/RNTupleReader.hxx>
+#if ROOT_VERSION_CODE >= ROOT_VERSION(6,36,0)
+namespace RNTupleNS = ROOT;
+#else
+namespace RNTupleNS = ROOT::Experimental;
+#endif
+#endif
 
 double truth_alpha(double wavelength, double ABWFF=1.30, double RAYFF=0.75) {
     const int NUMENTRIES_water=60;
@@ -79,22 +113,6 @@ double truth_alpha(double wavelength, double ABWFF=1.30, double RAYFF=0.75) {
     return alpha;
 }
 
-double PoissonLLH (double mc, double w2, double data)
-{
-
-        // Standard Poisson LLH.
-        double chi2 = 0.0;
-        if(mc > 0.0)
-        {
-            chi2 = 2 * (mc - data);
-            if(data > 0.0)
-                chi2 += 2 * data * std::log(data / mc);
-        }
-
-        return (chi2 >= 0.0) ? chi2 : 0.0;
-
-}
-
 TH1D* hRate1; // number of PE per PMT
 TH1D* hRate0; // number of PE per PMT
 TH2D* hBinnedRate1; // number of PE binned in R and costh
@@ -104,16 +122,164 @@ TH2D* hPMT0;
 TH2D* hPMT1;
 TH2D* hPMT1mPMT;
 int m_calls;
-std::vector<double> mPMT_R;
-std::vector<double> mPMT_costh;
-std::vector<double> mPMT_costh_mPMT;
-std::vector<double> PMT_R;
-std::vector<double> PMT_costh;
+int m_grad_calls; // evaluations of the analytic gradient (and Hessian), counted separately from m_calls
+// Geometry and use flags of the channels as seen from one source position
+struct ChannelGeometry {
+    std::vector<double> mPMT_R;
+    std::vector<double> mPMT_costh;
+    std::vector<double> mPMT_costh_mPMT;
+    std::vector<double> PMT_R;
+    std::vector<double> PMT_costh;
+    std::vector<char> mPMT_use;
+    std::vector<char> PMT_use;
+
+    ChannelView view() const {
+        ChannelView v = {(int)PMT_R.size(), (int)mPMT_R.size(),
+                         PMT_R.data(), PMT_costh.data(), PMT_use.data(),
+                         mPMT_R.data(), mPMT_costh.data(), mPMT_costh_mPMT.data(), mPMT_use.data()};
+        return v;
+    }
+};
+ChannelGeometry geom; // channels of the loaded (single) source
 std::vector<double> costh_array;
-std::vector<bool> mPMT_use;
-std::vector<bool> PMT_use;
 bool usemPMT;
 bool usePMT;
+bool useNormB = true; // fit the non-PMT angular parameters B, false fixes them to 1
+std::vector<int> mPMT_mask; // 1 = mPMT channel masked out of the fit
+int nmPMT_sim, nPMT_sim; // number of channels in the geometry trees
+int nmPMT_used, nPMT_used; // number of channels within the source opening angle
+int min_PMTid;
+// Binning and channel selection of the loaded fit, for the shared likelihood kernel
+LikelihoodConfig likelihood_config()
+{
+    LikelihoodConfig cfg = {hBinnedRate0->GetNbinsX(), hBinnedRate0->GetXaxis()->GetXmin(), hBinnedRate0->GetXaxis()->GetXmax(),
+                            usemPMT, usePMT, useNormB};
+    return cfg;
+}
+
+// Likelihood instantiation and configuration of the current fit, selected once by create_fitter
+LikelihoodConfig fit_likelihood_config;
+LikelihoodKernel likelihood_kernel = 0;
+void select_likelihood()
+{
+    fit_likelihood_config = likelihood_config();
+    likelihood_kernel = SelectLikelihood(fit_likelihood_config);
+}
+
+// Likelihood of one source, see AttenuationLikelihoodT in attenuation_likelihood.h
+double EvalSourceLikelihood(const double* par, const ChannelView& g, const double* rate0, const double* rate1, double norm = 1)
+{
+    if (likelihood_kernel) return likelihood_kernel(par, fit_likelihood_config, g, rate0, rate1, norm);
+    return AttenuationLikelihood(par, likelihood_config(), g, rate0, rate1, norm);
+}
+
+// Likelihood of the loaded single source for the per-channel rates rate0 (B&L) and rate1 (mPMT)
+double EvalLikelihood(const double* par, const double* rate0, const double* rate1)
+{
+    return EvalSourceLikelihood(par, geom.view(), rate0, rate1);
+}
+
+// Joint fit of several source positions sharing alpha and the angular normalizations, with one intensity
+// parameter per source after the first. Empty for single-source fits.
+std::vector<ChannelGeometry> source_geom;
+std::vector<std::vector<double> > source_rate0;
+std::vector<std::vector<double> > source_rate1;
+int fit_nthreads = 1; // threads used to evaluate the sources of the joint likelihood
+
+double EvalJointLikelihood(const double* par)
+{
+    int nCosthBins = hBinnedRate0->GetNbinsX();
+    int nsources = source_geom.size();
+    for (int s=1; s<nsources; s++)
+        if (par[3*nCosthBins+s]<0) return 1e20;
+
+    // sum in a fixed order so that the result does not depend on the thread scheduling
+    std::vector<double> chi2(nsources,0);
+    run_parallel(nsources, std::min(fit_nthreads,nsources), [&](int s, int t) {
+        double norm = s==0 ? 1 : par[3*nCosthBins+s];
+        chi2[s] = EvalSourceLikelihood(par, source_geom[s].view(), source_rate0[s].data(), source_rate1[s].data(), norm);
+    });
+    double chi2_stat = 0;
+    for (int s=0; s<nsources; s++) chi2_stat += chi2[s];
+    return chi2_stat;
+}
+
+// Flat binary fit input file, see export_fit_inputs
+const char fit_input_magic[8] = {'W','C','A','T','T','F','I','T'};
+const unsigned int fit_input_version = 1;
+const size_t fit_input_alignment = 64;
+struct FitInputHeader {
+    char magic[8];
+    unsigned int version;
+    int nPMT, nmPMT;
+    int nmPMT_on;
+    double timetof_min, timetof_max, cosths_min; // selection the rates were made with
+    // byte offsets from the start of the file of PMT_R, PMT_costh, PMT_use, rate0,
+    // mPMT_R, mPMT_costh, mPMT_costh_mPMT, mPMT_use, rate1
+    unsigned long long offset[9];
+    unsigned long long size; // total file size
+};
+
+// Fit inputs memory-mapped by load_fit_inputs, used by the likelihood instead of geom and hRate0/1 when data is set
+struct MappedFitInput {
+    void* data;
+    size_t size;
+    const FitInputHeader* header;
+    ChannelView channels;
+    const double* rate0;
+    const double* rate1;
+};
+MappedFitInput mapped_input = {0,0,0,{},0,0};
+
+// Whether geom and hRate0/1 hold the per-channel inputs of the current fit (fit_all or fill_rate_window),
+// which is what export_fit_inputs writes
+bool channel_rates_loaded = false;
+
+void unload_fit_inputs()
+{
+    if (mapped_input.data) munmap(mapped_input.data,mapped_input.size);
+    mapped_input = {0,0,0,{},0,0};
+    channel_rates_loaded = false;
+    likelihood_kernel = 0;
+}
+
+// Mixed precision evaluation: channel terms in single precision with compensated summation, validated against the
+// double precision fit with check_float_likelihood. The channels are copied by run_fit, one entry per source.
+bool likelihood_float = false;
+std::vector<CompactChannels> compact_channels;
+
+void build_compact_channels()
+{
+    LikelihoodConfig cfg = likelihood_config();
+    if (!source_geom.empty()) {
+        compact_channels.resize(source_geom.size());
+        for (size_t s=0; s<source_geom.size(); s++)
+            compact_channels[s].Build(cfg, source_geom[s].view(), source_rate0[s].data(), source_rate1[s].data());
+    }
+    else {
+        compact_channels.resize(1);
+        if (mapped_input.data) compact_channels[0].Build(cfg, mapped_input.channels, mapped_input.rate0, mapped_input.rate1);
+        else compact_channels[0].Build(cfg, geom.view(), hRate0->GetArray()+1, hRate1->GetArray()+1);
+    }
+}
+
+double EvalFloatLikelihood(const double* par)
+{
+    int nCosthBins = hBinnedRate0->GetNbinsX();
+    int nsources = compact_channels.size();
+    for (int s=1; s<nsources; s++)
+        if (par[3*nCosthBins+s]<0) return 1e20;
+
+    std::vector<double> chi2(nsources,0);
+    run_parallel(nsources, std::min(fit_nthreads,nsources), [&](int s, int t) {
+        double norm = s==0 ? 1 : par[3*nCosthBins+s];
+        chi2[s] = AttenuationLikelihoodFloat(par, nCosthBins, compact_channels[s], norm);
+    });
+    KahanSum chi2_stat;
+    for (int s=0; s<nsources; s++) chi2_stat.Add(chi2[s]);
+    return chi2_stat.sum;
+}
+
 double CalcLikelihood(const double* par)
 {
     m_calls++;
@@ -125,48 +291,13 @@ double CalcLikelihood(const double* par)
 
     int nCosthBins = hBinnedRate0->GetNbinsX();
 
-    for(int i=1; i<=nCosthBins; i++){
-        if(par[i]<0) return 1e20;
-        if(par[i+nCosthBins]<0) return 1e20;
-    }
-    
-    double chi2_stat = 0;
-
-    double* data_w  = hRate1->GetArray();
-    double* data_w2 = hRate1->GetSumw2()->GetArray();
-
-    if(usemPMT) {
-        for (int i = 0; i < hRate1->GetNbinsX(); i++) {
-            if (!mPMT_use[i]) continue;
-            double value = TMath::Exp(-mPMT_R[i] / par[0]) / mPMT_R[i] / mPMT_R[i] * 9000 * 9000; //an arbitrary normalization
-            double costh_pmt = mPMT_costh[i];
-            double costh_mpmt = mPMT_costh_mPMT[i];
-            int costh_idx = hBinnedRate1->GetXaxis()->FindBin(costh_pmt);
-            int costh_mPMT_idx = hBinnedRate1mPMT->GetXaxis()->FindBin(costh_mpmt);
-            if (costh_idx >= 1 && costh_idx <= hBinnedRate1->GetNbinsX() &&
-                costh_mPMT_idx >= 1 && costh_mPMT_idx <= hBinnedRate1mPMT->GetNbinsX()) {
-                value *= par[costh_idx];
-                value *= par[costh_mPMT_idx + 2*nCosthBins];
-                chi2_stat += PoissonLLH(value, 0, hRate1->GetBinContent(i+1));
-            }
-        }
+    // bin 0 of the rate histograms is the underflow
+    double chi2_stat;
+    if (likelihood_float && !compact_channels.empty()) chi2_stat = EvalFloatLikelihood(par);
+    else if (!source_geom.empty()) chi2_stat = EvalJointLikelihood(par);
+    else if (mapped_input.data) chi2_stat = EvalSourceLikelihood(par, mapped_input.channels, mapped_input.rate0, mapped_input.rate1);
+    else chi2_stat = EvalLikelihood(par, hRate0->GetArray()+1, hRate1->GetArray()+1);
 
-    }
-    if(usePMT) {
-        for (int i = 0; i < hRate0->GetNbinsX(); i++) {
-            if (!PMT_use[i]) continue;
-            double value =
-                    TMath::Exp(-PMT_R[i] / par[0]) / PMT_R[i] / PMT_R[i] * 9000 * 9000; //an arbitrary normalization
-            double costh_pmt = PMT_costh[i];
-            int costh_idx = hBinnedRate0->GetXaxis()->FindBin(costh_pmt);
-            if (costh_idx >= 1 && costh_idx <= nCosthBins) {
-                value *= par[costh_idx + nCosthBins];
-                value *= par[costh_idx + 2*nCosthBins];
-                chi2_stat += PoissonLLH(value, 0, hRate0->GetBinContent(i+1));
-            }
-        }
-
-    }
     if(output_chi2)
     {
         std::cout << "Func Calls: " << m_calls << std::endl;
@@ -185,20 +316,225 @@ double CalcLikelihood(const double* par)
 }
 
 
-void run_fit(const char* minName = "Minuit2", const char* algoName="Migrad"){
-    int nCosthBins = hBinnedRate1->GetNbinsX();
-    int m_npar = nCosthBins*3+1; // number of costh bins * 2 (for 2 PMT types) + number of costh bins (for non-PMT effects) + one alpha parameter
-//    int m_npar = nCosthBins*2+1; // number of costh bins * 2 (for 2 PMT types) + one alpha parameter
-//    int m_npar = nCosthBins+1; // number of costh bins + one alpha parameter
-    m_calls = 0;
-    ROOT::Math::Minimizer* m_fitter = ROOT::Math::Factory::CreateMinimizer(minName, algoName);
-    ROOT::Math::Functor m_fcn(&CalcLikelihood, m_npar);
+// Value, gradient and optionally Hessian of EvalSourceLikelihood added to grad and hess, see AttenuationDerivatives
+double EvalSourceDerivatives(const double* par, const ChannelView& g, const double* rate0, const double* rate1,
+                             int npar, double* grad, double* hess, double norm = 1, int norm_index = -1)
+{
+    return AttenuationDerivatives(par, likelihood_config(), g, rate0, rate1, npar, grad, hess, norm, norm_index);
+}
 
-    std::cout<<"Number of free parameters = "<<m_fcn.NDim()<<std::endl;
+// Analytic derivatives of CalcLikelihood for the inputs currently loaded. grad and hess (may be null) are overwritten.
+double CalcDerivatives(const double* par, int npar, double* grad, double* hess)
+{
+    m_grad_calls++;
+    std::fill(grad,grad+npar,0.);
+    if (hess) std::fill(hess,hess+npar*npar,0.);
+    if (!source_geom.empty()) {
+        int nCosthBins = hBinnedRate0->GetNbinsX();
+        int nsources = source_geom.size();
+        std::vector<std::vector<double> > grads(nsources,std::vector<double>(npar,0));
+        std::vector<std::vector<double> > hesss(nsources,std::vector<double>(hess ? npar*npar : 0,0));
+        std::vector<double> chi2(nsources,0);
+        run_parallel(nsources, std::min(fit_nthreads,nsources), [&](int s, int t) {
+            chi2[s] = EvalSourceDerivatives(par, source_geom[s].view(), source_rate0[s].data(), source_rate1[s].data(),
+                                            npar, grads[s].data(), hess ? hesss[s].data() : 0, 1, s==0 ? -1 : 3*nCosthBins+s);
+        });
+        double chi2_stat = 0;
+        for (int s=0; s<nsources; s++) {
+            chi2_stat += chi2[s];
+            for (int i=0;i<npar;i++) grad[i] += grads[s][i];
+            if (hess) for (int i=0;i<npar*npar;i++) hess[i] += hesss[s][i];
+        }
+        return chi2_stat;
+    }
+    if (mapped_input.data)
+        return EvalSourceDerivatives(par, mapped_input.channels, mapped_input.rate0, mapped_input.rate1, npar, grad, hess);
+    return EvalSourceDerivatives(par, geom.view(), hRate0->GetArray()+1, hRate1->GetArray()+1, npar, grad, hess);
+}
+
+// Likelihood with its analytic gradient, so that Migrad does not need finite differences
+class AttenuationFCN : public ROOT::Math::IGradientFunctionMultiDim {
+public:
+    AttenuationFCN(unsigned int npar) : fNpar(npar) {}
+    ROOT::Math::IGradientFunctionMultiDim* Clone() const { return new AttenuationFCN(fNpar); }
+    unsigned int NDim() const { return fNpar; }
+    void Gradient(const double* x, double* grad) const { CalcDerivatives(x, fNpar, grad, 0); }
+private:
+    double DoEval(const double* x) const { return CalcLikelihood(x); }
+    double DoDerivative(const double* x, unsigned int icoord) const {
+        std::vector<double> grad(fNpar);
+        CalcDerivatives(x, fNpar, grad.data(), 0);
+        return grad[icoord];
+    }
+    unsigned int fNpar;
+};
 
-    m_fitter->SetFunction(m_fcn);
+// Covariance (npar x npar, zero for fixed parameters) from the analytic Hessian at par: cov = 2 H^-1 over the free
+// parameters for a chi2 with up = 1. Returns false if the Hessian is not positive definite.
+bool analytic_covariance(ROOT::Math::Minimizer* m_fitter, const double* par, std::vector<double>& cov)
+{
+    int npar = m_fitter->NDim();
+    std::vector<double> grad(npar), hess(npar*npar);
+    CalcDerivatives(par, npar, grad.data(), hess.data());
+    std::vector<int> free_par;
+    for (int i=0;i<npar;i++)
+        if (!m_fitter->IsFixedVariable(i)) free_par.push_back(i);
+    int n = free_par.size();
+    TMatrixDSym h(n);
+    for (int a=0;a<n;a++)
+        for (int b=0;b<n;b++) h(a,b) = hess[free_par[a]*npar+free_par[b]];
+    h.Invert();
+    cov.assign(npar*npar,0.);
+    if (!h.IsValid()) return false;
+    for (int a=0;a<n;a++) {
+        if (h(a,a)<=0) return false;
+        for (int b=0;b<n;b++) cov[free_par[a]*npar+free_par[b]] = 2*h(a,b);
+    }
+    return true;
+}
+
+struct FitResult {
+    int status;
+    double minValue;
+    std::vector<double> par;
+    std::vector<double> err;
+    std::vector<double> cov; // npar x npar, row major
+};
+FitResult fit_result; // result of the last call to run_fit
+std::vector<double> fit_start_par; // if set, run_fit starts from these values instead of a cached fit
+
+// Input selection and binning a fit result depends on, used as the key of the fit cache
+struct FitConfig {
+    std::string filename;
+    int nmPMT_on;
+    bool mPMT, PMT;
+    double timetof_min, timetof_max;
+    int nbins_costh; double costh_min, costh_max;
+    int nbins_dist; double dist_min, dist_max;
+    double cosths_min;
+    std::string source; // entry point and rate source the rates were built with
+    std::string inputs; // fingerprint of the input files, see input_fingerprint
+    bool useNormB = true; // B parameters fitted, set from the global by run_fit
+    std::string stages;   // fit_stages settings, set by run_fit
+};
+FitConfig fit_config; // configuration of the inputs currently loaded, set before calling run_fit
+
+// Results of previous fits are appended to this file. New fits start from the nearest converged cached result,
+// and a fit with an identical configuration is taken from the cache. Set to "" to disable.
+std::string fit_cache_file = "fit_cache.txt";
+
+// Number of files matching the pattern and a 64-bit FNV-1a hash of their paths, sizes and modification times, so that
+// cached fits are not reused after files are added, rewritten or topped up with analysis_absorption -a
+std::string input_fingerprint(const std::string& pattern)
+{
+    glob_t matches;
+    if (glob(pattern.c_str(),0,NULL,&matches)!=0) return "";
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i=0;i<matches.gl_pathc;i++) {
+        struct stat st;
+        if (stat(matches.gl_pathv[i],&st)!=0) continue;
+        std::string entry = Form("%s %lld %lld.%09ld;",matches.gl_pathv[i],(long long)st.st_size,
+                                 (long long)st.st_mtim.tv_sec,(long)st.st_mtim.tv_nsec);
+        for (size_t k=0;k<entry.size();k++) {
+            hash ^= (unsigned char)entry[k];
+            hash *= 1099511628211ULL;
+        }
+    }
+    std::string fingerprint = Form("%i:%016llx",(int)matches.gl_pathc,hash);
+    globfree(&matches);
+    return fingerprint;
+}
+
+// Distance between two configurations: hit time window differences in ns plus the difference in the fraction of
+// mPMT modules used, plus 1 if the input files, the rate source or the fit stages differ, so that such results are
+// only used as starting points. Returns -1 if the results cannot be used for each other (different inputs or binning).
+double config_distance(const FitConfig& a, const FitConfig& b)
+{
+    if (a.filename!=b.filename || a.mPMT!=b.mPMT || a.PMT!=b.PMT ||
+        a.nbins_costh!=b.nbins_costh || a.costh_min!=b.costh_min || a.costh_max!=b.costh_max ||
+        a.nbins_dist!=b.nbins_dist || a.dist_min!=b.dist_min || a.dist_max!=b.dist_max ||
+        a.cosths_min!=b.cosths_min)
+        return -1;
+    int nmodules = nmPMT_sim/19;
+    double frac_a = a.nmPMT_on>0 && nmodules>0 ? (a.nmPMT_on+0.)/nmodules : 1.;
+    double frac_b = b.nmPMT_on>0 && nmodules>0 ? (b.nmPMT_on+0.)/nmodules : 1.;
+    double changed = (a.inputs!=b.inputs || a.inputs=="" || a.source!=b.source || a.useNormB!=b.useNormB ||
+                      a.stages!=b.stages) ? 1 : 0;
+    return fabs(a.timetof_min-b.timetof_min)+fabs(a.timetof_max-b.timetof_max)+fabs(frac_a-frac_b)+changed;
+}
+
+// Version tag of the cache lines, lines of other versions are ignored
+const char* fit_cache_version = "v4";
+
+void write_config(std::ostream& out, const FitConfig& c)
+{
+    out<<fit_cache_version<<" "<<std::quoted(c.filename)<<" "<<c.nmPMT_on<<" "<<c.mPMT<<" "<<c.PMT<<" "<<c.timetof_min<<" "<<c.timetof_max<<" "
+       <<c.nbins_costh<<" "<<c.costh_min<<" "<<c.costh_max<<" "<<c.nbins_dist<<" "<<c.dist_min<<" "<<c.dist_max<<" "<<c.cosths_min<<" "
+       <<std::quoted(c.source)<<" "<<std::quoted(c.inputs)<<" "<<c.useNormB<<" "<<std::quoted(c.stages);
+}
+
+bool read_config(std::istream& in, FitConfig& c)
+{
+    std::string version;
+    in>>version;
+    if (version!=fit_cache_version) return false;
+    in>>std::quoted(c.filename)>>c.nmPMT_on>>c.mPMT>>c.PMT>>c.timetof_min>>c.timetof_max
+      >>c.nbins_costh>>c.costh_min>>c.costh_max>>c.nbins_dist>>c.dist_min>>c.dist_max>>c.cosths_min
+      >>std::quoted(c.source)>>std::quoted(c.inputs)>>c.useNormB>>std::quoted(c.stages);
+    return !in.fail();
+}
+
+// Append a fit result to the cache file: one line with the configuration, status, parameters, errors and covariance
+void save_cached_fit(const FitConfig& config, const FitResult& result)
+{
+    if (fit_cache_file=="") return;
+    std::ofstream out(fit_cache_file.c_str(),std::ios::app);
+    out<<std::setprecision(17);
+    write_config(out,config);
+    out<<" "<<result.status<<" "<<result.minValue<<" "<<result.par.size();
+    for (size_t i=0;i<result.par.size();i++) out<<" "<<result.par[i];
+    for (size_t i=0;i<result.err.size();i++) out<<" "<<result.err[i];
+    for (size_t i=0;i<result.cov.size();i++) out<<" "<<result.cov[i];
+    out<<std::endl;
+}
+
+// Find the converged cached result nearest to config. Returns its distance, or -1 if there is none.
+double find_cached_fit(const FitConfig& config, FitResult& result)
+{
+    if (fit_cache_file=="") return -1;
+    std::ifstream in(fit_cache_file.c_str());
+    double best = -1;
+    std::string line;
+    while (std::getline(in,line)) {
+        std::istringstream ss(line);
+        FitConfig c;
+        FitResult r;
+        size_t npar;
+        if (!read_config(ss,c)) continue;
+        ss>>r.status>>r.minValue>>npar;
+        r.par.resize(npar); r.err.resize(npar); r.cov.resize(npar*npar);
+        for (size_t i=0;i<npar;i++) ss>>r.par[i];
+        for (size_t i=0;i<npar;i++) ss>>r.err[i];
+        for (size_t i=0;i<npar*npar;i++) ss>>r.cov[i];
+        if (ss.fail() || r.status!=0) continue;
+        double d = config_distance(config,c);
+        if (d<0) continue;
+        if (best<0 || d<=best) { // later entries win ties
+            best = d;
+            result = r;
+        }
+    }
+    return best;
+}
+
+// Create a minimizer with the attenuation model parameters, their starting values, and the parameters
+// without data in their costh bin fixed. The function still has to be set by the caller.
+ROOT::Math::Minimizer* create_fitter(const char* minName = "Minuit2", const char* algoName="Migrad", int printLevel = 2){
+    int nCosthBins = hBinnedRate1->GetNbinsX();
+
+    ROOT::Math::Minimizer* m_fitter = ROOT::Math::Factory::CreateMinimizer(minName, algoName);
     m_fitter->SetStrategy(1);
-    m_fitter->SetPrintLevel(2);
+    m_fitter->SetPrintLevel(printLevel);
     m_fitter->SetTolerance(1.e-4);
     m_fitter->SetMaxIterations(1.e6);
     m_fitter->SetMaxFunctionCalls(1.e9);
@@ -215,72 +551,257 @@ void run_fit(const char* minName = "Minuit2", const char* algoName="Migrad"){
     }
     // one of the B parameters must be fixed, since increasing all B params and reducing all norm params by the same factor has no overall effect
     m_fitter->FixVariable(nCosthBins*3);
+    if (!useNormB) for (int i=1;i<nCosthBins+1;i++) m_fitter->FixVariable(i+2*nCosthBins);
+    select_likelihood();
     for (int i=1; i<nCosthBins+1; i++){
       double rate3 = hBinnedRate1->Integral(i,i,1,hBinnedRate1->GetNbinsY());
       double rate3mPMT = hBinnedRate1mPMT->Integral(i,i,1,hBinnedRate1mPMT->GetNbinsY());
       double rate20 = hBinnedRate0->Integral(i,i,1,hBinnedRate0->GetNbinsY());
       if(!usemPMT || rate3 < 0.00001) {
-        cout << "Fixing param " << i << endl;
+        if(printLevel>0) cout << "Fixing param " << i << endl;
         m_fitter->FixVariable(i);
       }
       if(!usePMT || rate20 < 0.00001) {
-        cout << "Fixing param " << i+nCosthBins << endl;
+        if(printLevel>0) cout << "Fixing param " << i+nCosthBins << endl;
         m_fitter->FixVariable(i+nCosthBins);
       }
       if(rate20 < 0.00001 && rate3mPMT < 0.00001){
         m_fitter->FixVariable(i+2*nCosthBins);
       }
     }
+
+    return m_fitter;
+}
+
+// Configuration of the minimization stages in run_fit
+struct FitStages {
+    bool prefit;            // strategy 0 minimization with alpha fixed before the full fit
+    int hesse;              // 0 = no Hesse, 1 = full Hesse, 2 = Hessian of alpha and the parameters correlated with it only,
+                            // 3 = analytic Hessian
+    bool minos_alpha;       // MINOS errors on alpha
+    double corr_threshold;  // minimum |correlation| with alpha (from the Migrad covariance) for the restricted Hessian
+    bool analytic_gradient; // give Migrad the analytic gradient of the likelihood
+    bool check_analytic;    // compare the analytic covariance with the numerical Hesse result
+};
+FitStages fit_stages = {false, 1, false, 0.05, false, false};
+
+// Error on alpha from the numerical Hessian restricted to alpha and the free parameters whose Migrad correlation
+// with alpha exceeds corr_threshold. The correlations with the other parameters are neglected.
+double restricted_alpha_error(ROOT::Math::Minimizer* m_fitter, double corr_threshold)
+{
+    int npar = m_fitter->NDim();
+    std::vector<double> x(m_fitter->X(),m_fitter->X()+npar);
+    const double* err = m_fitter->Errors();
+    std::vector<int> idx(1,0);
+    for (int i=1;i<npar;i++) {
+        if (m_fitter->IsFixedVariable(i) || err[i]<=0) continue;
+        if (fabs(m_fitter->Correlation(0,i))>corr_threshold) idx.push_back(i);
+    }
+    int n = idx.size();
+    std::cout << "Computing Hessian of alpha and " << n-1 << " correlated parameters" << std::endl;
+
+    // central finite differences with a tenth of the Migrad error as step
+    std::vector<double> h(n);
+    for (int a=0;a<n;a++) h[a] = 0.1*err[idx[a]];
+    double f0 = CalcLikelihood(x.data());
+    TMatrixDSym hessian(n);
+    for (int a=0;a<n;a++) {
+        int i = idx[a];
+        double xi = x[i];
+        x[i] = xi+h[a]; double fp = CalcLikelihood(x.data());
+        x[i] = xi-h[a]; double fm = CalcLikelihood(x.data());
+        x[i] = xi;
+        hessian(a,a) = (fp-2*f0+fm)/(h[a]*h[a]);
+        for (int b=0;b<a;b++) {
+            int j = idx[b];
+            double xj = x[j];
+            x[i] = xi+h[a]; x[j] = xj+h[b]; double fpp = CalcLikelihood(x.data());
+            x[j] = xj-h[b]; double fpm = CalcLikelihood(x.data());
+            x[i] = xi-h[a]; double fmm = CalcLikelihood(x.data());
+            x[j] = xj+h[b]; double fmp = CalcLikelihood(x.data());
+            x[i] = xi; x[j] = xj;
+            hessian(a,b) = (fpp-fpm-fmp+fmm)/(4*h[a]*h[b]);
+            hessian(b,a) = hessian(a,b);
+        }
+    }
+    // chi2 with up = 1: covariance = 2 * H^-1
+    hessian.Invert();
+    if (!hessian.IsValid() || hessian(0,0)<=0) {
+        std::cout << "Restricted Hessian is not positive definite" << std::endl;
+        return -1;
+    }
+    return sqrt(2*hessian(0,0));
+}
+
+void run_fit(const char* minName = "Minuit2", const char* algoName="Migrad"){
+    int nCosthBins = hBinnedRate1->GetNbinsX();
+    int m_npar = nCosthBins*3+1; // number of costh bins * 2 (for 2 PMT types) + number of costh bins (for non-PMT effects) + one alpha parameter
+//    int m_npar = nCosthBins*2+1; // number of costh bins * 2 (for 2 PMT types) + one alpha parameter
+//    int m_npar = nCosthBins+1; // number of costh bins + one alpha parameter
+    int nsources = source_geom.size();
+    if (nsources>1) m_npar += nsources-1; // intensity of each source relative to the first one
+    m_calls = 0;
+    m_grad_calls = 0;
+    compact_channels.clear();
+    if (likelihood_float) build_compact_channels();
+    ROOT::Math::Minimizer* m_fitter = create_fitter(minName, algoName);
+    for (int s=1; s<nsources; s++) {
+        double q0 = 0, qs = 0;
+        for (size_t i=0;i<source_rate0[0].size();i++) q0 += source_rate0[0][i];
+        for (size_t i=0;i<source_rate1[0].size();i++) q0 += source_rate1[0][i];
+        for (size_t i=0;i<source_rate0[s].size();i++) qs += source_rate0[s][i];
+        for (size_t i=0;i<source_rate1[s].size();i++) qs += source_rate1[s][i];
+        m_fitter->SetVariable(nCosthBins*3+s, Form("srcnorm_%i",s), q0>0 ? qs/q0 : 1., 0.01);
+    }
+    ROOT::Math::Functor m_fcn(&CalcLikelihood, m_npar);
+    AttenuationFCN m_gradfcn(m_npar);
+
+    std::cout<<"Number of free parameters = "<<m_fcn.NDim()<<std::endl;
+
+    if (fit_stages.analytic_gradient) m_fitter->SetFunction(m_gradfcn);
+    else m_fitter->SetFunction(m_fcn);
+
+    fit_config.useNormB = useNormB;
+    fit_config.stages = Form("%i %i %i %g %i %i",fit_stages.prefit,fit_stages.hesse,fit_stages.minos_alpha,
+                             fit_stages.corr_threshold,fit_stages.analytic_gradient,fit_stages.check_analytic);
+    FitResult cached;
+    double cache_distance = fit_start_par.empty() ? find_cached_fit(fit_config,cached) : -1;
+    // float fits are not saved in the cache, so a cached identical fit is always a double precision one
+    if (cache_distance==0 && !likelihood_float && (int)cached.par.size()==m_npar) {
+        std::cout << "Identical fit found in " << fit_cache_file << ", not refitting." << std::endl;
+        fit_result = cached;
+        for (int i=0;i<m_npar;i++) {
+            std::cout<<m_fitter->VariableName(i)<<": "<<cached.par[i]<<" +/- "<<cached.err[i]<<std::endl;
+        }
+        delete m_fitter;
+        return;
+    }
+    if ((cache_distance>0 || (cache_distance==0 && likelihood_float)) && (int)cached.par.size()==m_npar) {
+        std::cout << "Starting from cached fit at distance " << cache_distance << std::endl;
+        for (int i=0;i<m_npar;i++) {
+            m_fitter->SetVariableValue(i,cached.par[i]);
+            if (cached.err[i]>0) m_fitter->SetVariableStepSize(i,cached.err[i]);
+        }
+    }
+    if ((int)fit_start_par.size()==m_npar) {
+        std::cout << "Starting from the given parameters" << std::endl;
+        for (int i=0;i<m_npar;i++) m_fitter->SetVariableValue(i,fit_start_par[i]);
+    }
+    // the likelihood kernels without B still get them multiplied in by the float and gradient paths, so keep them at 1
+    if (!useNormB) for (int i=1;i<nCosthBins+1;i++) m_fitter->SetVariableValue(i+2*nCosthBins,1.);
     
     bool did_converge = false;
     std::cout <<"Fit prepared." << std::endl;
-//    std::cout <<"Fixing alpha" << std::endl;
-//    m_fitter->FixVariable(0);
-//    std::cout <<"Calling Minimize, running " << minName << ", "<< algoName << std::endl;
-//    did_converge = m_fitter->Minimize();
-//    if(!did_converge)
-//    {
-//        std::cout << "Fit did not converge."<< std::endl;
-//        std::cout << "Failed with status code: " << m_fitter->Status() << std::endl;
-//    }
-//    else
-//    {
-//        std::cout  << "Fit converged." << std::endl
-//                   << "Status code: " << m_fitter->Status() << std::endl;
-//
-//        std::cout << "Calling HESSE." << std::endl;
-//        did_converge = m_fitter->Hesse();
-//    }
-//    std::cout <<"Releasing alpha" << std::endl;
-//    m_fitter->ReleaseVariable(0);
+    std::vector<std::pair<std::string,std::pair<int,int> > > stage_calls; // function and gradient calls per stage
+    int calls_before = m_calls, grad_calls_before = m_grad_calls;
+    auto end_stage = [&](const char* name) {
+        stage_calls.push_back(std::make_pair(std::string(name),std::make_pair(m_calls-calls_before,m_grad_calls-grad_calls_before)));
+        calls_before = m_calls;
+        grad_calls_before = m_grad_calls;
+    };
+    if(fit_stages.prefit)
+    {
+        // cheap strategy 0 fit of the normalization parameters, the full fit then starts from there
+        std::cout <<"Fixing alpha" << std::endl;
+        m_fitter->FixVariable(0);
+        m_fitter->SetStrategy(0);
+        std::cout <<"Calling Minimize (pre-fit), running " << minName << ", "<< algoName << std::endl;
+        did_converge = m_fitter->Minimize();
+        if(!did_converge)
+            std::cout << "Pre-fit did not converge, status code: " << m_fitter->Status() << std::endl;
+        std::cout <<"Releasing alpha" << std::endl;
+        m_fitter->ReleaseVariable(0);
+        m_fitter->SetStrategy(1);
+        end_stage("pre-fit");
+    }
     std::cout <<"Calling Minimize, running " << minName << ", "<< algoName << std::endl;
     did_converge = m_fitter->Minimize();
+    end_stage("minimize");
 
     if(!did_converge)
     {
         std::cout << "Fit did not converge."<< std::endl;
         std::cout << "Failed with status code: " << m_fitter->Status() << std::endl;
     }
-    else
+    else if(fit_stages.hesse==1)
     {
         std::cout  << "Fit converged." << std::endl
                    << "Status code: " << m_fitter->Status() << std::endl;
 
         std::cout << "Calling HESSE." << std::endl;
         did_converge = m_fitter->Hesse();
-    }
+        end_stage("hesse");
 
-    if(!did_converge)
-    {
-        std::cout << "Hesse did not converge." << std::endl;
-        std::cout << "Failed with status code: " << m_fitter->Status() << std::endl;
+        if(!did_converge)
+        {
+            std::cout << "Hesse did not converge." << std::endl;
+            std::cout << "Failed with status code: " << m_fitter->Status() << std::endl;
+        }
+        else
+        {
+            std::cout  << "Hesse converged." << std::endl
+                       << "Status code: " << m_fitter->Status() << std::endl;
+        }
     }
     else
     {
-        std::cout  << "Hesse converged." << std::endl
+        std::cout  << "Fit converged." << std::endl
                    << "Status code: " << m_fitter->Status() << std::endl;
     }
 
+    double alpha_err_restricted = -1;
+    if(did_converge && fit_stages.hesse==2)
+    {
+        alpha_err_restricted = restricted_alpha_error(m_fitter, fit_stages.corr_threshold);
+        end_stage("restricted hesse");
+    }
+    std::vector<double> analytic_cov;
+    if(did_converge && (fit_stages.hesse==3 || fit_stages.check_analytic))
+    {
+        std::cout << "Computing analytic Hessian." << std::endl;
+        if(!analytic_covariance(m_fitter, m_fitter->X(), analytic_cov))
+        {
+            std::cout << "Analytic Hessian is not positive definite." << std::endl;
+            analytic_cov.clear();
+        }
+        end_stage("analytic hessian");
+    }
+    if(did_converge && fit_stages.check_analytic && !analytic_cov.empty())
+    {
+        if(fit_stages.hesse!=1)
+        {
+            std::cout << "Calling HESSE for the analytic cross-check." << std::endl;
+            m_fitter->Hesse();
+            end_stage("hesse");
+        }
+        const double* err = m_fitter->Errors();
+        double max_diff = 0;
+        int max_par = 0;
+        for (int i=0;i<m_npar;i++) {
+            if (m_fitter->IsFixedVariable(i) || err[i]<=0) continue;
+            double diff = fabs(sqrt(analytic_cov[i*m_npar+i])/err[i]-1);
+            if (diff>max_diff) { max_diff = diff; max_par = i; }
+        }
+        std::cout << "alpha error: analytic " << sqrt(analytic_cov[0]) << ", Hesse " << err[0] << std::endl;
+        std::cout << "Largest relative difference of the errors: " << max_diff << " for " << m_fitter->VariableName(max_par) << std::endl;
+    }
+    if(did_converge && fit_stages.minos_alpha)
+    {
+        double err_low, err_up;
+        std::cout << "Calling MINOS on alpha." << std::endl;
+        if(m_fitter->GetMinosError(0, err_low, err_up))
+            std::cout << "MINOS alpha error: " << err_low << " +" << err_up << std::endl;
+        else
+            std::cout << "MINOS failed on alpha." << std::endl;
+        end_stage("minos alpha");
+    }
+    std::cout << "Function calls per stage:" << std::endl;
+    for (size_t i=0;i<stage_calls.size();i++) {
+        std::cout << "  " << stage_calls[i].first << ": " << stage_calls[i].second.first;
+        if (stage_calls[i].second.second>0) std::cout << ", " << stage_calls[i].second.second << " gradient";
+        std::cout << std::endl;
+    }
+
     const double* par_val = m_fitter->X();
     const double* par_err = m_fitter->Errors();
 
@@ -288,154 +809,397 @@ void run_fit(const char* minName = "Minuit2", const char* algoName="Migrad"){
         std::cout<<m_fitter->VariableName(i)<<": "<<par_val[i]<<" +/- "<<par_err[i]<<std::endl;
     }
 
+    fit_result.status = m_fitter->Status();
+    fit_result.minValue = m_fitter->MinValue();
+    fit_result.par.assign(par_val,par_val+m_npar);
+    fit_result.err.assign(par_err,par_err+m_npar);
+    fit_result.cov.resize(m_npar*m_npar);
+    m_fitter->GetCovMatrix(fit_result.cov.data());
+    if (fit_stages.hesse==3 && !analytic_cov.empty()) {
+        std::cout<<"Errors from the analytic Hessian:"<<std::endl;
+        fit_result.cov = analytic_cov;
+        for (int i=0;i<m_npar;i++) {
+            fit_result.err[i] = sqrt(analytic_cov[i*m_npar+i]);
+            std::cout<<m_fitter->VariableName(i)<<": "<<par_val[i]<<" +/- "<<fit_result.err[i]<<std::endl;
+        }
+    }
+    if (alpha_err_restricted>0) {
+        std::cout<<"alpha: "<<par_val[0]<<" +/- "<<alpha_err_restricted<<" (restricted Hessian)"<<std::endl;
+        fit_result.err[0] = alpha_err_restricted;
+        fit_result.cov[0] = alpha_err_restricted*alpha_err_restricted;
+    }
+    if (!likelihood_float) save_cached_fit(fit_config,fit_result); // the cache only holds double precision fits
+
 }
 
+// Fit the loaded inputs in double and in mixed precision and check that every free parameter agrees within
+// tolerance times its error. The cache is not used for either fit.
+bool check_float_likelihood(double tolerance = 0.01)
+{
+    std::string cache_file = fit_cache_file;
+    bool use_float = likelihood_float;
+    fit_cache_file = "";
 
-void fit_all(   std::string filename, int nmPMT_on=0, // number of mPMT modules used fit, 0 = using all
-                bool mPMT = true, bool PMT = true,
-                double timetof_min = -952, double timetof_max = -945, // hit time window
-                int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1., // binning in costh
-                int nbins_dist=100, double dist_min = 1000, double dist_max=9000, // binning R
-                double cosths_min = 0.766 // limit due to source opening angle
-            ) 
+    likelihood_float = false;
+    run_fit();
+    FitResult fit_double = fit_result;
+    likelihood_float = true;
+    run_fit();
+    FitResult fit_float = fit_result;
+    double llh_float = CalcLikelihood(fit_double.par.data());
+    likelihood_float = false;
+    double llh_double = CalcLikelihood(fit_double.par.data());
+
+    fit_cache_file = cache_file;
+    likelihood_float = use_float;
+
+    double max_dev = 0;
+    int max_par = 0;
+    for (size_t i=0;i<fit_double.par.size();i++) {
+        if (fit_double.err[i]<=0) continue;
+        double dev = fabs(fit_float.par[i]-fit_double.par[i])/fit_double.err[i];
+        if (dev>max_dev) { max_dev = dev; max_par = i; }
+    }
+    bool pass = fit_double.status==0 && fit_float.status==0 && max_dev<tolerance;
+    std::cout<<"Mixed precision check:"<<std::endl;
+    std::cout<<"alpha: double "<<fit_double.par[0]<<" +/- "<<fit_double.err[0]<<", float "<<fit_float.par[0]<<std::endl;
+    std::cout<<"Likelihood at the double precision minimum: double "<<std::setprecision(12)<<llh_double
+             <<", float "<<llh_float<<std::setprecision(6)<<std::endl;
+    std::cout<<"Largest parameter difference: "<<max_dev<<" sigma (parameter "<<max_par<<"), tolerance "<<tolerance<<std::endl;
+    std::cout<<(pass ? "PASSED" : "FAILED")<<std::endl;
+    return pass;
+}
+
+
+const int nPMTpermPMT = 19;
+
+// File holding the pmt_type0/1 tables of a reduced file: the file itself, or the geometry sidecar it references
+// (analysis_absorption -g), looked up in the directory of the file
+TFile* geometry_file(TFile* f)
 {
-    usemPMT = mPMT;
-    usePMT = PMT;
-    gROOT->Reset();
-    gStyle->SetOptFit(1111);
-    gStyle->SetOptStat(0);
+    if (f->Get("pmt_type1")) return f;
+    TNamed* sidecar = (TNamed*)f->Get("geometry_sidecar");
+    if (!sidecar) return f;
+    std::string path = f->GetName();
+    size_t slash = path.find_last_of('/');
+    path = (slash==std::string::npos ? "" : path.substr(0,slash+1)) + sidecar->GetTitle();
+    TFile* gf = TFile::Open(path.c_str());
+    if (!gf || gf->IsZombie()) {
+        std::cout<<"Could not open geometry sidecar "<<path<<std::endl;
+        return f;
+    }
+    return gf;
+}
 
-    TChain* hitRate_pmtType1 = new TChain("hitRate_pmtType1");
-    hitRate_pmtType1->Add(filename.c_str());
+// Whether the hits of a reduced file are stored as RNTuple (analysis_absorption -n) instead of TTree
+bool is_ntuple(TFile* f, const char* name)
+{
+    TKey* key = f->GetKey(name);
+    return key && std::string(key->GetClassName()).find("RNTuple")!=std::string::npos;
+}
 
-    //Only the first file is used to extract the PMT geometry
-    TFile* f = hitRate_pmtType1->GetFile();
+#ifdef HAVE_RNTUPLE
+// Add the charge of the hits in the time window to rate[PMT_id-id_offset], reading the RNTuple of the chain's name
+// from each of its files. Only the nPE, timetof and PMT_id columns are read.
+void sum_ntuple_charge(TChain* chain, double timetof_min, double timetof_max,
+                       const std::vector<char>& use, int id_offset, std::vector<double>& rate)
+{
+    TIter next(chain->GetListOfFiles());
+    while (TObject* element = next()) {
+        auto reader = RNTupleNS::RNTupleReader::Open(chain->GetName(),element->GetTitle());
+        auto nPE = reader->GetView<double>("nPE");
+        auto timetof = reader->GetView<double>("timetof");
+        auto PMT_id = reader->GetView<int>("PMT_id");
+        for (auto i : reader->GetEntryRange()) {
+            int ch = PMT_id(i)-id_offset;
+            if (ch<0 || ch>=(int)use.size() || !use[ch]) continue; // out of range (corrupt file or other geometry) or not used
+            double t = timetof(i);
+            if (t>timetof_min&&t<timetof_max) rate[ch] += nPE(i);
+        }
+    }
+}
+#endif
 
-    double nHits, nPE, dist, costh, costh_mPMT, cosths, timetof;
-    int PMT_id;
+// Whether none of the files of the chain holds its hits as RNTuple (analysis_absorption -n). Only fit_all reads those,
+// the TChain readers of the other entry points would silently see no hits.
+bool check_chain_ttree(TChain* chain)
+{
+    TIter next(chain->GetListOfFiles());
+    while (TObject* element = next()) {
+        TFile* f = TFile::Open(element->GetTitle());
+        if (!f) continue;
+        bool ntuple = is_ntuple(f,"hitRate_pmtType0") || is_ntuple(f,"hitRate_pmtType1");
+        delete f;
+        if (ntuple) {
+            std::cout<<"Error, "<<element->GetTitle()<<" holds RNTuple hits, which are only read by fit_all. Reduce without -n."<<std::endl;
+            return false;
+        }
+    }
+    return true;
+}
 
-    hPMT1 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
-    hPMT1mPMT = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
-    TTree* pmt_type1 = (TTree*)f->Get("pmt_type1");
-    pmt_type1->SetBranchAddress("dist",&dist);
-    pmt_type1->SetBranchAddress("costh",&costh);
-    pmt_type1->SetBranchAddress("cosths",&cosths);
-    pmt_type1->SetBranchAddress("PMT_id",&PMT_id);
-    pmt_type1->SetBranchAddress("costh_mPMT",&costh_mPMT);
+// Check that all files of a chain were reduced with the same geometry and source positions, using the
+// geometry_hash written by analysis_absorption. Files without a hash are not checked.
+bool check_chain_geometry(TChain* chain)
+{
+    std::string reference;
+    int nmissing = 0;
+    TIter next(chain->GetListOfFiles());
+    while (TObject* element = next()) {
+        TFile* f = TFile::Open(element->GetTitle());
+        if (!f) continue;
+        TNamed* hash = (TNamed*)f->Get("geometry_hash");
+        std::string value = hash ? hash->GetTitle() : "";
+        delete f;
+        if (value=="") nmissing++;
+        else if (reference=="") reference = value;
+        else if (value!=reference) {
+            std::cout<<"Error: "<<element->GetTitle()<<" has geometry "<<value<<", other files have "<<reference<<std::endl;
+            return false;
+        }
+    }
+    if (nmissing>0) std::cout<<"Warning: "<<nmissing<<" files without geometry hash, their geometry is not checked"<<std::endl;
+    return true;
+}
 
-    // uniformly masking mPMT modules when requested
-    int nPMTpermPMT = 19;
-    int nmPMT_sim = pmt_type1->GetEntries();
-    int * mPMT_mask = new int[nmPMT_sim];
+// Mask (1 = masked) of the nmPMT_sim mPMT channels keeping nmPMT_on modules spread uniformly, 0 = all modules on
+std::vector<int> uniform_mPMT_mask(int nmPMT_on, int nmPMT_sim)
+{
+    std::vector<int> mask(nmPMT_sim,0);
     if (nmPMT_on>0){
         double mPMT_frac = (nmPMT_on+0.)/(nmPMT_sim/nPMTpermPMT);
         int mPMT_count = 0;
         for (int i=0;i<nmPMT_sim/nPMTpermPMT;i++){
             if ((mPMT_count+0.)/(i+1.)<mPMT_frac && mPMT_count<nmPMT_on) {
                 for (int j=i*nPMTpermPMT;j<(i+1)*nPMTpermPMT;j++) {
-                    mPMT_mask[j]=0;
+                    mask[j]=0;
                 }
                 mPMT_count++;
             } else {
                 for (int j=i*nPMTpermPMT;j<(i+1)*nPMTpermPMT;j++) {
-                    mPMT_mask[j]=1;
+                    mask[j]=1;
                 }
             }
         }
     }
+    return mask;
+}
+
+// Fill the per-channel geometry vectors, use flags and hPMT* maps from the pmt_type0/1 trees (of f or its sidecar).
+// Only the first file of a chain is used to extract the PMT geometry.
+// Only the table of the given source_id is read from files with several source positions.
+void load_pmt_geometry( TFile* f, int nmPMT_on, // number of mPMT modules used fit, 0 = using all
+                        int nbins_costh, double costh_min, double costh_max,
+                        int nbins_dist, double dist_min, double dist_max,
+                        double cosths_min, int source = 0, ChannelGeometry& g = geom
+                      )
+{
+    double dist, costh, costh_mPMT, cosths;
+    int PMT_id, source_id = 0;
+
+    TFile* gf = geometry_file(f);
+    hPMT1 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hPMT1mPMT = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    TTree* pmt_type1 = (TTree*)gf->Get("pmt_type1");
+    pmt_type1->SetBranchAddress("dist",&dist);
+    pmt_type1->SetBranchAddress("costh",&costh);
+    pmt_type1->SetBranchAddress("cosths",&cosths);
+    pmt_type1->SetBranchAddress("PMT_id",&PMT_id);
+    pmt_type1->SetBranchAddress("costh_mPMT",&costh_mPMT);
+    bool select_source = pmt_type1->GetBranch("source_id")!=0;
+    if (select_source) pmt_type1->SetBranchAddress("source_id",&source_id);
 
-    int nmPMT_used=0;
-    mPMT_use.clear();mPMT_R.clear();mPMT_costh.clear();mPMT_costh_mPMT.clear();
-    mPMT_use.resize(nmPMT_sim,false);
+    // uniformly masking mPMT modules when requested
+    nmPMT_sim = 0;
     for (int i=0;i<pmt_type1->GetEntries();i++) {
-        pmt_type1->GetEntry(i);
-        mPMT_R.push_back(dist);
-        mPMT_costh.push_back(-costh);
-        mPMT_costh_mPMT.push_back(-costh_mPMT);
+        if (select_source) { pmt_type1->GetEntry(i); if (source_id!=source) continue; }
+        nmPMT_sim++;
+    }
+    mPMT_mask = uniform_mPMT_mask(nmPMT_on,nmPMT_sim);
+
+    nmPMT_used=0;
+    g.mPMT_use.clear();g.mPMT_R.clear();g.mPMT_costh.clear();g.mPMT_costh_mPMT.clear();
+    g.mPMT_use.resize(nmPMT_sim,false);
+    for (int entry=0;entry<pmt_type1->GetEntries();entry++) {
+        pmt_type1->GetEntry(entry);
+        if (select_source && source_id!=source) continue;
+        int i = g.mPMT_R.size();
+        g.mPMT_R.push_back(dist);
+        g.mPMT_costh.push_back(-costh);
+        g.mPMT_costh_mPMT.push_back(-costh_mPMT);
         if (nmPMT_on>0)
             if (mPMT_mask[PMT_id]==1) continue; // ignore masked PMT
         if (cosths>cosths_min) // only include PMT within the source opening angle 
         {
             hPMT1->Fill(-costh,dist);
             hPMT1mPMT->Fill(-costh_mPMT,dist);
-            mPMT_use[i]=true;
+            g.mPMT_use[i]=true;
             nmPMT_used++;
         }
     }
     
     hPMT0 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
-    TTree* pmt_type0 = (TTree*)f->Get("pmt_type0");
+    TTree* pmt_type0 = (TTree*)gf->Get("pmt_type0");
     pmt_type0->SetBranchAddress("dist",&dist);
     pmt_type0->SetBranchAddress("costh",&costh);
     pmt_type0->SetBranchAddress("cosths",&cosths);
     pmt_type0->SetBranchAddress("PMT_id",&PMT_id);
-    int nPMT_sim = pmt_type1->GetEntries();
-    int min_PMTid = 99999999;
-    int nPMT_used=0;
-    PMT_use.clear();PMT_R.clear();PMT_costh.clear();
-    PMT_use.resize(nmPMT_sim,false);
+    if (select_source) pmt_type0->SetBranchAddress("source_id",&source_id);
+    nPMT_sim = 0;
     for (int i=0;i<pmt_type0->GetEntries();i++) {
-        pmt_type0->GetEntry(i);
+        if (select_source) { pmt_type0->GetEntry(i); if (source_id!=source) continue; }
+        nPMT_sim++;
+    }
+    min_PMTid = 99999999;
+    nPMT_used=0;
+    g.PMT_use.clear();g.PMT_R.clear();g.PMT_costh.clear();
+    g.PMT_use.resize(nPMT_sim,false);
+    for (int entry=0;entry<pmt_type0->GetEntries();entry++) {
+        pmt_type0->GetEntry(entry);
+        if (select_source && source_id!=source) continue;
+        int i = g.PMT_R.size();
         if(PMT_id < min_PMTid) min_PMTid = PMT_id;
-        PMT_R.push_back(dist);
-        PMT_costh.push_back(-costh);
+        g.PMT_R.push_back(dist);
+        g.PMT_costh.push_back(-costh);
         if (cosths>cosths_min) // only include PMT within the source opening angle 
         {
             hPMT0->Fill(-costh,dist);
-            PMT_use[i]=true;
+            g.PMT_use[i]=true;
             nPMT_used++;
         }
     }
-    
+}
+
+// Fill hRate0/1 and the binned rates from per-channel charge totals, in one pass over the channels in use
+void fill_channel_rates(const double* rate0, const double* rate1)
+{
+    channel_rates_loaded = true;
+    hRate1->Reset(); hBinnedRate1->Reset(); hBinnedRate1mPMT->Reset();
+    for (int i=0;i<nmPMT_sim;i++) {
+        if (!geom.mPMT_use[i] || rate1[i]<=0) continue;
+        hRate1->Fill(i+0.5,rate1[i]);
+        hBinnedRate1->Fill(geom.mPMT_costh[i],geom.mPMT_R[i],rate1[i]);
+        hBinnedRate1mPMT->Fill(geom.mPMT_costh_mPMT[i],geom.mPMT_R[i],rate1[i]);
+    }
+    hRate0->Reset(); hBinnedRate0->Reset();
+    for (int i=0;i<nPMT_sim;i++) {
+        if (!geom.PMT_use[i] || rate0[i]<=0) continue;
+        hRate0->Fill(i+0.5,rate0[i]);
+        hBinnedRate0->Fill(geom.PMT_costh[i],geom.PMT_R[i],rate0[i]);
+    }
+}
+
+// Returns false if the input is refused, fit_result then still holds the previous fit
+bool fit_all(   std::string filename, int nmPMT_on=0, // number of mPMT modules used fit, 0 = using all
+                bool mPMT = true, bool PMT = true,
+                double timetof_min = -952, double timetof_max = -945, // hit time window
+                int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1., // binning in costh
+                int nbins_dist=100, double dist_min = 1000, double dist_max=9000, // binning R
+                double cosths_min = 0.766 // limit due to source opening angle
+            ) 
+{
+    usemPMT = mPMT;
+    usePMT = PMT;
+    unload_fit_inputs();
+    source_geom.clear();
+    fit_config = {filename,nmPMT_on,mPMT,PMT,timetof_min,timetof_max,
+                  nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min,
+                  "fit_all",input_fingerprint(filename)};
+    gROOT->Reset();
+    gStyle->SetOptFit(1111);
+    gStyle->SetOptStat(0);
+
+    TChain* hitRate_pmtType1 = new TChain("hitRate_pmtType1");
+    hitRate_pmtType1->Add(filename.c_str());
+
+    //Only the first file is used to extract the PMT geometry
+    if (!check_chain_geometry(hitRate_pmtType1)) return false;
+    TFile* f = hitRate_pmtType1->GetFile();
+    if (!f && hitRate_pmtType1->GetListOfFiles()->GetEntries()>0) // hits stored as RNTuple
+        f = TFile::Open(hitRate_pmtType1->GetListOfFiles()->At(0)->GetTitle());
+    if (!f) {
+        std::cout<<"Error, no input file "<<filename<<std::endl;
+        return false;
+    }
+    bool ntuple = is_ntuple(f,"hitRate_pmtType1");
+#ifndef HAVE_RNTUPLE
+    if (ntuple) {
+        std::cout<<"Error, "<<f->GetName()<<" holds RNTuple hits, which need ROOT 6.34 or later"<<std::endl;
+        return false;
+    }
+#endif
+
+    double nPE, timetof;
+    int PMT_id;
+
+    TTree* sources = (TTree*)f->Get("sources");
+    if (sources && sources->GetEntries()>1) {
+        // the hits of all sources would be summed into rates fitted with the geometry of the first one
+        std::cout<<"Error, "<<sources->GetEntries()<<" source positions in the input, use fit_sources for a joint fit"<<std::endl;
+        return false;
+    }
+    load_pmt_geometry(f,nmPMT_on,nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min);
+
     TH1::SetDefaultSumw2(true);
 
     hRate1 = new TH1D("","",nmPMT_sim,0,nmPMT_sim);
     hBinnedRate1 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
     hBinnedRate1mPMT = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hRate0 = new TH1D("","",nPMT_sim,0,nPMT_sim);
+    hBinnedRate0 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
 
-    hitRate_pmtType1->SetBranchAddress("dist",&dist);
-    hitRate_pmtType1->SetBranchAddress("costh",&costh);
-    hitRate_pmtType1->SetBranchAddress("costh_mPMT",&costh_mPMT);
-    hitRate_pmtType1->SetBranchAddress("cosths",&cosths);
-    hitRate_pmtType1->SetBranchAddress("nHits",&nHits);
+    // All hits of a PMT share its geometry, so the hits are only summed per PMT here and the
+    // binned rates are derived from the per-PMT totals afterwards
+    auto read_start = std::chrono::steady_clock::now();
+    std::vector<double> rate1(nmPMT_sim,0);
+    std::vector<double> rate0(nPMT_sim,0);
+    TChain* hitRate_pmtType0 = new TChain("hitRate_pmtType0");
+    hitRate_pmtType0->Add(filename.c_str());
+#ifdef HAVE_RNTUPLE
+    if (ntuple) {
+        sum_ntuple_charge(hitRate_pmtType1,timetof_min,timetof_max,geom.mPMT_use,0,rate1);
+        sum_ntuple_charge(hitRate_pmtType0,timetof_min,timetof_max,geom.PMT_use,min_PMTid,rate0);
+    }
+    else {
+#endif
+    hitRate_pmtType1->SetBranchStatus("*",false);
+    hitRate_pmtType1->SetBranchStatus("nPE",true);
+    hitRate_pmtType1->SetBranchStatus("timetof",true);
+    hitRate_pmtType1->SetBranchStatus("PMT_id",true);
     hitRate_pmtType1->SetBranchAddress("nPE",&nPE);
     hitRate_pmtType1->SetBranchAddress("timetof",&timetof);
     hitRate_pmtType1->SetBranchAddress("PMT_id",&PMT_id);
 
     for (ULong64_t i=0;i<hitRate_pmtType1->GetEntries();i++) {
         hitRate_pmtType1->GetEntry(i);
-        if (nmPMT_on>0)
-            if (mPMT_mask[PMT_id]==1) continue;
-        if (cosths>cosths_min&&timetof>timetof_min&&timetof<timetof_max) // only hits within the decided time window and the source opening angle  
-        {
-            double weight = nPE;
-            hRate1->Fill(PMT_id+0.5,weight);
-            hBinnedRate1->Fill(-costh,dist,weight);
-            hBinnedRate1mPMT->Fill(-costh_mPMT,dist,weight);
-        }
+        if (PMT_id<0 || PMT_id>=nmPMT_sim) continue; // corrupt file or other geometry
+        if (!geom.mPMT_use[PMT_id]) continue; // masked or outside the source opening angle
+        if (timetof>timetof_min&&timetof<timetof_max) // only hits within the decided time window
+            rate1[PMT_id] += nPE;
     }
-    delete[] mPMT_mask;
 
-    TChain* hitRate_pmtType0 = new TChain("hitRate_pmtType0");
-    hitRate_pmtType0->Add(filename.c_str());
-    hitRate_pmtType0->SetBranchAddress("dist",&dist);
-    hitRate_pmtType0->SetBranchAddress("costh",&costh);
-    hitRate_pmtType0->SetBranchAddress("cosths",&cosths);
-    hitRate_pmtType0->SetBranchAddress("nHits",&nHits);
+    hitRate_pmtType0->SetBranchStatus("*",false);
+    hitRate_pmtType0->SetBranchStatus("nPE",true);
+    hitRate_pmtType0->SetBranchStatus("timetof",true);
+    hitRate_pmtType0->SetBranchStatus("PMT_id",true);
     hitRate_pmtType0->SetBranchAddress("nPE",&nPE);
     hitRate_pmtType0->SetBranchAddress("timetof",&timetof);
     hitRate_pmtType0->SetBranchAddress("PMT_id",&PMT_id);
-    hRate0 = new TH1D("","",nPMT_sim,0,nPMT_sim);
-    hBinnedRate0 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
     for (ULong64_t i=0;i<hitRate_pmtType0->GetEntries();i++) {
         hitRate_pmtType0->GetEntry(i);
-        if (cosths>cosths_min&&timetof>timetof_min&&timetof<timetof_max) // only hits within the decided time window and the source opening angle  
-        {
-            double weight = nPE;
-            hRate0->Fill(PMT_id-min_PMTid+0.5,weight);
-            hBinnedRate0->Fill(-costh,dist,weight);
-        }
+        int ch = PMT_id-min_PMTid;
+        if (ch<0 || ch>=nPMT_sim) continue; // corrupt file or other geometry
+        if (!geom.PMT_use[ch]) continue; // outside the source opening angle
+        if (timetof>timetof_min&&timetof<timetof_max) // only hits within the decided time window
+            rate0[ch] += nPE;
     }
+#ifdef HAVE_RNTUPLE
+    }
+#endif
+    std::cout<<"Read the hits ("<<(ntuple ? "RNTuple" : "TTree")<<") in "
+             <<std::chrono::duration<double>(std::chrono::steady_clock::now()-read_start).count()<<" s"<<std::endl;
+
+    fill_channel_rates(rate0.data(),rate1.data());
 
     TCanvas* c1 = new TCanvas();
     hBinnedRate1->GetXaxis()->SetTitle("cos(#theta_{PMT})");
@@ -502,7 +1266,997 @@ void fit_all(   std::string filename, int nmPMT_on=0, // number of mPMT modules
     std::cout<<"Number of non-zero mPMT bins = "<<nonzerobins1<<std::endl;
     std::cout<<"Number of PMT_used = "<<nPMT_used<<std::endl;
     std::cout<<"Number of non-zero PMT bins = "<<nonzerobins0<<std::endl;
+    return true;
+}
+
+// Write the per-channel fit inputs currently loaded (geometry, use flags and rates of fit_all) to a versioned flat
+// binary file with 64-byte aligned arrays, which load_fit_inputs maps directly into memory.
+bool export_fit_inputs(const char* outname)
+{
+    if (!channel_rates_loaded || !hRate0 || !hRate1 ||
+        (int)geom.PMT_use.size()!=nPMT_sim || (int)geom.mPMT_use.size()!=nmPMT_sim) {
+        std::cout<<"No per-channel inputs of fit_all or fit_timetof_windows loaded, nothing exported"<<std::endl;
+        return false;
+    }
+    FitInputHeader header;
+    memset(&header,0,sizeof(header));
+    memcpy(header.magic,fit_input_magic,sizeof(header.magic));
+    header.version = fit_input_version;
+    header.nPMT = nPMT_sim;
+    header.nmPMT = nmPMT_sim;
+    header.nmPMT_on = fit_config.nmPMT_on;
+    header.timetof_min = fit_config.timetof_min;
+    header.timetof_max = fit_config.timetof_max;
+    header.cosths_min = fit_config.cosths_min;
+
+    const void* arrays[9] = {geom.PMT_R.data(), geom.PMT_costh.data(), geom.PMT_use.data(), hRate0->GetArray()+1,
+                             geom.mPMT_R.data(), geom.mPMT_costh.data(), geom.mPMT_costh_mPMT.data(), geom.mPMT_use.data(), hRate1->GetArray()+1};
+    size_t bytes[9] = {nPMT_sim*sizeof(double), nPMT_sim*sizeof(double), nPMT_sim*sizeof(char), nPMT_sim*sizeof(double),
+                       nmPMT_sim*sizeof(double), nmPMT_sim*sizeof(double), nmPMT_sim*sizeof(double), nmPMT_sim*sizeof(char), nmPMT_sim*sizeof(double)};
+    size_t pos = sizeof(header);
+    for (int k=0;k<9;k++) {
+        pos = (pos+fit_input_alignment-1)/fit_input_alignment*fit_input_alignment;
+        header.offset[k] = pos;
+        pos += bytes[k];
+    }
+    header.size = pos;
+
+    FILE* out = fopen(outname,"wb");
+    if (!out) {
+        std::cout<<"Cannot open "<<outname<<" for writing"<<std::endl;
+        return false;
+    }
+    std::vector<char> padding(fit_input_alignment,0);
+    fwrite(&header,sizeof(header),1,out);
+    pos = sizeof(header);
+    for (int k=0;k<9;k++) {
+        fwrite(padding.data(),1,header.offset[k]-pos,out);
+        fwrite(arrays[k],1,bytes[k],out);
+        pos = header.offset[k]+bytes[k];
+    }
+    bool ok = ferror(out)==0;
+    fclose(out);
+    std::cout<<"Fit inputs of "<<nPMT_sim<<" B&L and "<<nmPMT_sim<<" mPMT channels written to "<<outname<<std::endl;
+    return ok;
+}
+
+// Map a file written by export_fit_inputs. The likelihood then reads the channel arrays in place, without ROOT I/O
+// or copies, and the binned rates used to fix empty parameters are derived from them.
+bool load_fit_inputs(   const char* filename,
+                        int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1.,
+                        int nbins_dist=100, double dist_min = 1000, double dist_max=9000
+                    )
+{
+    unload_fit_inputs();
+    source_geom.clear();
+    int fd = open(filename,O_RDONLY);
+    if (fd<0) {
+        std::cout<<"Cannot open "<<filename<<std::endl;
+        return false;
+    }
+    struct stat st;
+    fstat(fd,&st);
+    if ((size_t)st.st_size<sizeof(FitInputHeader)) {
+        std::cout<<filename<<" is too small to be a fit input file"<<std::endl;
+        close(fd);
+        return false;
+    }
+    // MAP_SHARED lets concurrent fit processes share the page-cached inputs
+    void* data = mmap(0,st.st_size,PROT_READ,MAP_SHARED,fd,0);
+    close(fd);
+    if (data==MAP_FAILED) {
+        std::cout<<"Cannot map "<<filename<<std::endl;
+        return false;
+    }
+    const FitInputHeader* header = (const FitInputHeader*)data;
+    if (memcmp(header->magic,fit_input_magic,sizeof(header->magic))!=0 || header->version!=fit_input_version ||
+        header->size!=(unsigned long long)st.st_size) {
+        std::cout<<filename<<" is not a version "<<fit_input_version<<" fit input file"<<std::endl;
+        munmap(data,st.st_size);
+        return false;
+    }
+    // the arrays must lie inside the file, double arrays aligned, before any view is built on them
+    bool valid = header->nPMT>=0 && header->nmPMT>=0;
+    for (int k=0;k<9 && valid;k++) {
+        unsigned long long count = k<4 ? header->nPMT : header->nmPMT;
+        unsigned long long elem = (k==2 || k==7) ? sizeof(char) : sizeof(double);
+        valid = header->offset[k]>=sizeof(FitInputHeader) && header->offset[k]<=header->size &&
+                count*elem<=header->size-header->offset[k] && header->offset[k]%elem==0;
+    }
+    if (!valid) {
+        std::cout<<filename<<" has invalid channel counts or array offsets"<<std::endl;
+        munmap(data,st.st_size);
+        return false;
+    }
+    const char* base = (const char*)data;
+    mapped_input.data = data;
+    mapped_input.size = st.st_size;
+    mapped_input.header = header;
+    ChannelView& v = mapped_input.channels;
+    v.nPMT = header->nPMT;
+    v.nmPMT = header->nmPMT;
+    v.PMT_R = (const double*)(base+header->offset[0]);
+    v.PMT_costh = (const double*)(base+header->offset[1]);
+    v.PMT_use = base+header->offset[2];
+    mapped_input.rate0 = (const double*)(base+header->offset[3]);
+    v.mPMT_R = (const double*)(base+header->offset[4]);
+    v.mPMT_costh = (const double*)(base+header->offset[5]);
+    v.mPMT_costh_mPMT = (const double*)(base+header->offset[6]);
+    v.mPMT_use = base+header->offset[7];
+    mapped_input.rate1 = (const double*)(base+header->offset[8]);
+    nPMT_sim = v.nPMT;
+    nmPMT_sim = v.nmPMT;
+
+    hBinnedRate1 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hBinnedRate1mPMT = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hBinnedRate0 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    for (int i=0;i<v.nmPMT;i++) {
+        if (!v.mPMT_use[i]) continue;
+        hBinnedRate1->Fill(v.mPMT_costh[i],v.mPMT_R[i],mapped_input.rate1[i]);
+        hBinnedRate1mPMT->Fill(v.mPMT_costh_mPMT[i],v.mPMT_R[i],mapped_input.rate1[i]);
+    }
+    for (int i=0;i<v.nPMT;i++) {
+        if (!v.PMT_use[i]) continue;
+        hBinnedRate0->Fill(v.PMT_costh[i],v.PMT_R[i],mapped_input.rate0[i]);
+    }
+
+    fit_config = {filename,header->nmPMT_on,usemPMT,usePMT,header->timetof_min,header->timetof_max,
+                  nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,header->cosths_min,
+                  "mapped",input_fingerprint(filename)};
+    return true;
+}
+
+// Fit the inputs of a file written by export_fit_inputs
+void fit_mapped_inputs( const char* filename, bool mPMT = true, bool PMT = true,
+                        int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1.,
+                        int nbins_dist=100, double dist_min = 1000, double dist_max=9000
+                      )
+{
+    usemPMT = mPMT;
+    usePMT = PMT;
+    if (!load_fit_inputs(filename,nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max)) return;
+    run_fit();
+}
+
+// Per-channel cumulative charge over fine timetof bins, used to get the rates of any time window with two lookups per channel.
+// cumRate[i*(nbins_timetof_cum+1)+k] is the summed PE of channel i with timetof in [timetof_cum_min, timetof_cum_min+k*timetof_cum_width)
+std::vector<double> cumRate0;
+std::vector<double> cumRate1;
+int nbins_timetof_cum = 0;
+double timetof_cum_min, timetof_cum_width;
+
+// Read the hit chains once and build the cumulative timetof histograms of all channels in use.
+// Photon timetof histograms written by analysis_absorption -r are added in as well.
+// load_pmt_geometry must have been called before.
+void build_timetof_cumulative(std::string filename, double timetof_min, double timetof_max, double timetof_width = 0.25)
+{
+    nbins_timetof_cum = (int)std::ceil((timetof_max-timetof_min)/timetof_width);
+    timetof_cum_min = timetof_min;
+    timetof_cum_width = timetof_width;
+    int stride = nbins_timetof_cum+1;
+    cumRate1.assign((size_t)nmPMT_sim*stride,0);
+    cumRate0.assign((size_t)nPMT_sim*stride,0);
+
+    double nPE, timetof;
+    int PMT_id;
+    for (int pmtType=0;pmtType<2;pmtType++) {
+        TChain* hitRate = new TChain(Form("hitRate_pmtType%i",pmtType));
+        hitRate->Add(filename.c_str());
+        hitRate->SetBranchStatus("*",false);
+        hitRate->SetBranchStatus("nPE",true);
+        hitRate->SetBranchStatus("timetof",true);
+        hitRate->SetBranchStatus("PMT_id",true);
+        hitRate->SetBranchAddress("nPE",&nPE);
+        hitRate->SetBranchAddress("timetof",&timetof);
+        hitRate->SetBranchAddress("PMT_id",&PMT_id);
+        std::vector<double>& cumRate = pmtType==0 ? cumRate0 : cumRate1;
+        std::vector<char>& use = pmtType==0 ? geom.PMT_use : geom.mPMT_use;
+        int id_offset = pmtType==0 ? min_PMTid : 0;
+        for (ULong64_t i=0;i<hitRate->GetEntries();i++) {
+            hitRate->GetEntry(i);
+            int ch = PMT_id-id_offset;
+            if (!use[ch]) continue; // masked or outside the source opening angle
+            if (timetof<timetof_min || timetof>=timetof_max) continue;
+            int bin = (int)((timetof-timetof_min)/timetof_width);
+            if (bin>=nbins_timetof_cum) continue;
+            cumRate[(size_t)ch*stride+bin+1] += nPE;
+        }
+        // photons binned by analysis_absorption -r; their bin centres are assigned to the cumulative bins
+        TIter next(hitRate->GetListOfFiles());
+        while (TObject* element = next()) {
+            TFile* f = TFile::Open(element->GetTitle());
+            if (!f) continue;
+            TH2D* hTimetof = (TH2D*)f->Get(Form("hTimetof_pmtType%i",pmtType));
+            if (hTimetof) {
+                int nch = cumRate.size()/stride;
+                for (int x=1;x<=hTimetof->GetNbinsX();x++) {
+                    int ch = x-1-id_offset;
+                    if (ch<0 || ch>=nch || !use[ch]) continue;
+                    for (int y=1;y<=hTimetof->GetNbinsY();y++) {
+                        double t = hTimetof->GetYaxis()->GetBinCenter(y);
+                        if (t<timetof_min || t>=timetof_max) continue;
+                        int bin = (int)((t-timetof_min)/timetof_width);
+                        if (bin>=nbins_timetof_cum) continue;
+                        cumRate[(size_t)ch*stride+bin+1] += hTimetof->GetBinContent(x,y);
+                    }
+                }
+            }
+            f->Close();
+        }
+        delete hitRate;
+        // turn the per-bin charge into prefix sums
+        for (size_t ch=0;ch<cumRate.size()/stride;ch++)
+            for (int k=1;k<stride;k++)
+                cumRate[ch*stride+k] += cumRate[ch*stride+k-1];
+    }
+    std::cout<<"Built cumulative timetof histograms with "<<nbins_timetof_cum<<" bins of "<<timetof_width<<" ns in ["<<timetof_min<<", "<<timetof_max<<"]"<<std::endl;
+}
+
+// Fill hRate0/1 and the binned rates for a time window from the cumulative histograms.
+// The window edges are rounded to the nearest cumulative bin edge.
+void fill_rate_window(double timetof_min, double timetof_max)
+{
+    int stride = nbins_timetof_cum+1;
+    int kmin = std::max(0,std::min(nbins_timetof_cum,(int)std::lround((timetof_min-timetof_cum_min)/timetof_cum_width)));
+    int kmax = std::max(0,std::min(nbins_timetof_cum,(int)std::lround((timetof_max-timetof_cum_min)/timetof_cum_width)));
+
+    std::vector<double> rate1(nmPMT_sim,0);
+    for (int i=0;i<nmPMT_sim;i++)
+        if (geom.mPMT_use[i]) rate1[i] = cumRate1[(size_t)i*stride+kmax]-cumRate1[(size_t)i*stride+kmin];
+    std::vector<double> rate0(nPMT_sim,0);
+    for (int i=0;i<nPMT_sim;i++)
+        if (geom.PMT_use[i]) rate0[i] = cumRate0[(size_t)i*stride+kmax]-cumRate0[(size_t)i*stride+kmin];
+    fill_channel_rates(rate0.data(),rate1.data());
+}
+
+// Fit a list of hit time windows reading the hits only once.
+// Window edges must lie inside [scan_min, scan_max], which is binned in steps of scan_width.
+void fit_timetof_windows(   std::string filename,
+                            std::vector<double> window_min, std::vector<double> window_max,
+                            double scan_min = -960, double scan_max = -930, double scan_width = 0.25,
+                            int nmPMT_on=0, bool mPMT = true, bool PMT = true,
+                            int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1.,
+                            int nbins_dist=100, double dist_min = 1000, double dist_max=9000,
+                            double cosths_min = 0.766
+                        )
+{
+    usemPMT = mPMT;
+    usePMT = PMT;
+    unload_fit_inputs();
+    source_geom.clear();
+
+    TChain* chain = new TChain("hitRate_pmtType1");
+    chain->Add(filename.c_str());
+    if (!check_chain_geometry(chain) || !check_chain_ttree(chain)) return;
+    if (!chain->GetFile()) {
+        std::cout<<"Error, no input file "<<filename<<std::endl;
+        return;
+    }
+    load_pmt_geometry(chain->GetFile(),nmPMT_on,nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min);
+    delete chain;
+
+    TH1::SetDefaultSumw2(true);
+    hRate1 = new TH1D("","",nmPMT_sim,0,nmPMT_sim);
+    hBinnedRate1 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hBinnedRate1mPMT = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hRate0 = new TH1D("","",nPMT_sim,0,nPMT_sim);
+    hBinnedRate0 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+
+    build_timetof_cumulative(filename,scan_min,scan_max,scan_width);
+    fit_config = {filename,nmPMT_on,mPMT,PMT,0,0,
+                  nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min,
+                  Form("timetof_windows %g %g",scan_min,scan_width),input_fingerprint(filename)};
+
+    std::vector<FitResult> results;
+    for (size_t w=0;w<window_min.size();w++) {
+        std::cout<<"Fitting time window ["<<window_min[w]<<", "<<window_max[w]<<"]"<<std::endl;
+        fill_rate_window(window_min[w],window_max[w]);
+        fit_config.timetof_min = window_min[w];
+        fit_config.timetof_max = window_max[w];
+        run_fit();
+        results.push_back(fit_result);
+    }
+
+    std::cout<<"Time window scan results:"<<std::endl;
+    for (size_t w=0;w<results.size();w++) {
+        std::cout<<"["<<window_min[w]<<", "<<window_max[w]<<"] alpha = "<<results[w].par[0]<<" +/- "<<results[w].err[0]
+                 <<", status "<<results[w].status<<std::endl;
+    }
+}
+
+// Quote a path for the shell, a ' inside is written as '\''
+std::string shell_quote(const std::string& arg)
+{
+    std::string quoted = "'";
+    for (size_t i=0;i<arg.size();i++) {
+        if (arg[i]=='\'') quoted += "'\\''";
+        else quoted += arg[i];
+    }
+    return quoted+"'";
+}
+
+// Watch a directory for new WCSim files, reduce each into the aggregate with analysis_absorption -a and refit the
+// aggregate in the time window at most every refit_interval seconds, starting from the previous fit. A file is reduced
+// once its size is unchanged between two polls. Each fit appends "time nfiles alpha alpha_err status" to series_file.
+// Runs until max_hours have passed (forever if 0); the manifest of the aggregate makes restarts skip reduced files.
+void watch_folder(  std::string dir, std::string aggregate,
+                    double timetof_min = -952, double timetof_max = -945,
+                    double refit_interval = 300, double poll_interval = 10,
+                    std::string series_file = "alpha_series.txt",
+                    std::string reducer = "./analysis_absorption", double max_hours = 0,
+                    int nmPMT_on=0, bool mPMT = true, bool PMT = true,
+                    int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1.,
+                    int nbins_dist=100, double dist_min = 1000, double dist_max=9000,
+                    double cosths_min = 0.766
+                )
+{
+    // every refit changes the aggregate, so identical configurations must not be taken from the cache
+    std::string cache_file = fit_cache_file;
+    fit_cache_file = "";
+    fit_start_par.clear();
+
+    std::map<std::string,long long> pending; // file size at the last poll
+    std::set<std::string> done;
+    int nreduced = 0, nnew = 0;
+    time_t start = time(0), last_fit = 0;
+    std::cout<<"Watching "<<dir<<", reducing into "<<aggregate<<std::endl;
+    while (max_hours<=0 || difftime(time(0),start)<max_hours*3600) {
+        std::vector<std::string> files;
+        if (DIR* d = opendir(dir.c_str())) {
+            while (dirent* entry = readdir(d)) {
+                std::string name = entry->d_name;
+                if (name.size()<5 || name.compare(name.size()-5,5,".root")!=0) continue;
+                files.push_back(dir+"/"+name);
+            }
+            closedir(d);
+        }
+        std::sort(files.begin(),files.end());
+        for (size_t i=0;i<files.size();i++) {
+            const std::string& path = files[i];
+            struct stat st, st_aggregate;
+            if (done.count(path) || stat(path.c_str(),&st)!=0) continue;
+            // the aggregate may sit in the watched directory under another spelling of its path
+            if (stat(aggregate.c_str(),&st_aggregate)==0 && st.st_dev==st_aggregate.st_dev && st.st_ino==st_aggregate.st_ino)
+                continue;
+            auto it = pending.find(path);
+            if (it==pending.end() || it->second!=st.st_size) { // new or still being written
+                pending[path] = st.st_size;
+                continue;
+            }
+            pending.erase(it);
+            done.insert(path);
+            std::string cmd = reducer+" -f "+shell_quote(path)+" -a "+shell_quote(aggregate);
+            if (gSystem->Exec(cmd.c_str())!=0) {
+                std::cout<<"Error, could not reduce "<<path<<std::endl;
+                continue;
+            }
+            nreduced++;
+            nnew++;
+        }
+
+        if (nnew>0 && difftime(time(0),last_fit)>=refit_interval) {
+            fit_result.par.clear();
+            fit_timetof_windows(aggregate,{timetof_min},{timetof_max},timetof_min,timetof_max,0.25,nmPMT_on,mPMT,PMT,
+                                nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min);
+            last_fit = time(0);
+            nnew = 0;
+            if (!fit_result.par.empty()) {
+                if (fit_result.status==0) fit_start_par = fit_result.par;
+                std::ofstream out(series_file.c_str(),std::ios::app);
+                out<<last_fit<<" "<<nreduced<<" "<<fit_result.par[0]<<" "<<fit_result.err[0]<<" "<<fit_result.status<<std::endl;
+                std::cout<<"After "<<nreduced<<" new files: alpha = "<<fit_result.par[0]<<" +/- "<<fit_result.err[0]<<std::endl;
+            }
+        }
+        gSystem->ProcessEvents();
+        std::this_thread::sleep_for(std::chrono::milliseconds((long)(poll_interval*1000)));
+    }
+    fit_start_par.clear();
+    fit_cache_file = cache_file;
+}
+
+// Per-block charge subtotals used for resampling. Channels 0..nPMT_sim-1 are B&L PMTs, the mPMT channels follow.
+std::vector<std::vector<float> > blockRate;
+
+// Read the hit chains and sum the charge in the time window separately for each block of events_per_block events.
+// Files reduced without the evt branch are treated as one block per file.
+void build_block_rates(std::string filename, double timetof_min, double timetof_max, int events_per_block = 100)
+{
+    blockRate.clear();
+    std::map<std::pair<int,int>,int> block_index; // (file, event block) -> block
+    int nch = nPMT_sim+nmPMT_sim;
+
+    double nPE, timetof;
+    int PMT_id, evt;
+    for (int pmtType=0;pmtType<2;pmtType++) {
+        TChain* hitRate = new TChain(Form("hitRate_pmtType%i",pmtType));
+        hitRate->Add(filename.c_str());
+        hitRate->SetBranchStatus("*",false);
+        hitRate->SetBranchStatus("nPE",true);
+        hitRate->SetBranchStatus("timetof",true);
+        hitRate->SetBranchStatus("PMT_id",true);
+        hitRate->SetBranchAddress("nPE",&nPE);
+        hitRate->SetBranchAddress("timetof",&timetof);
+        hitRate->SetBranchAddress("PMT_id",&PMT_id);
+        bool has_evt = hitRate->GetBranch("evt")!=0;
+        evt = 0;
+        if (has_evt) {
+            hitRate->SetBranchStatus("evt",true);
+            hitRate->SetBranchAddress("evt",&evt);
+        }
+        std::vector<char>& use = pmtType==0 ? geom.PMT_use : geom.mPMT_use;
+        for (ULong64_t i=0;i<hitRate->GetEntries();i++) {
+            hitRate->GetEntry(i);
+            int idx = pmtType==0 ? PMT_id-min_PMTid : PMT_id;
+            if (!use[idx]) continue;
+            int ch = pmtType==0 ? idx : nPMT_sim+idx;
+            if (timetof<=timetof_min || timetof>=timetof_max) continue;
+            std::pair<int,int> key(hitRate->GetTreeNumber(),evt/events_per_block);
+            std::map<std::pair<int,int>,int>::iterator it = block_index.find(key);
+            int b;
+            if (it==block_index.end()) {
+                b = blockRate.size();
+                block_index[key] = b;
+                blockRate.push_back(std::vector<float>(nch,0));
+            }
+            else b = it->second;
+            blockRate[b][ch] += nPE;
+        }
+        delete hitRate;
+    }
+    std::cout<<"Charge subtotals kept for "<<blockRate.size()<<" blocks of events"<<std::endl;
+}
+
+// Estimate the uncertainty on alpha by refitting bootstrap (or jackknife) replicas of the per-channel rates.
+// The nominal fit is done by fit_all, then replicas are built from per-block subtotals and fitted on nthreads threads,
+// each starting from the nominal best fit. Replica r uses the random seed seed+r, so results are reproducible.
+void fit_resampled( std::string filename, int nreplicas = 100, bool jackknife = false, int nthreads = 4,
+                    unsigned int seed = 12345, int events_per_block = 100,
+                    int nmPMT_on=0, bool mPMT = true, bool PMT = true,
+                    double timetof_min = -952, double timetof_max = -940
+                  )
+{
+    TChain chain("hitRate_pmtType1");
+    chain.Add(filename.c_str());
+    if (!check_chain_ttree(&chain)) return;
+    if (!fit_all(filename,nmPMT_on,mPMT,PMT,timetof_min,timetof_max)) return;
+    FitResult nominal = fit_result;
+
+    build_block_rates(filename,timetof_min,timetof_max,events_per_block);
+    int nblocks = blockRate.size();
+    if (nblocks<2) {
+        std::cout<<"At least two blocks of events are needed for resampling"<<std::endl;
+        return;
+    }
+    if (jackknife) nreplicas = nblocks;
+    int nch = nPMT_sim+nmPMT_sim;
+    std::vector<double> totalRate(nch,0);
+    for (int b=0;b<nblocks;b++)
+        for (int ch=0;ch<nch;ch++) totalRate[ch] += blockRate[b][ch];
+
+    ROOT::EnableThreadSafety();
+    // minimizers are created upfront, one per thread
+    std::vector<ROOT::Math::Minimizer*> fitters;
+    for (int t=0;t<nthreads;t++) fitters.push_back(create_fitter("Minuit2","Migrad",0));
+
+    std::vector<double> alpha(nreplicas,0);
+    std::vector<int> status(nreplicas,-1);
+    run_parallel(nreplicas,nthreads,[&](int r, int t) {
+        std::vector<double> rate;
+        if (jackknife) {
+            // leave out block r
+            rate = totalRate;
+            for (int ch=0;ch<nch;ch++) rate[ch] -= blockRate[r][ch];
+        } else {
+            // draw nblocks blocks with replacement
+            rate.assign(nch,0);
+            TRandom3 rng(seed+r);
+            for (int k=0;k<nblocks;k++) {
+                int b = rng.Integer(nblocks);
+                for (int ch=0;ch<nch;ch++) rate[ch] += blockRate[b][ch];
+            }
+        }
+        const double* rate0 = rate.data();
+        const double* rate1 = rate.data()+nPMT_sim;
+        ROOT::Math::Functor fcn([=](const double* par) { return EvalLikelihood(par,rate0,rate1); }, nominal.par.size());
+        ROOT::Math::Minimizer* fitter = fitters[t];
+        fitter->SetFunction(fcn);
+        fitter->SetVariableValues(nominal.par.data());
+        fitter->Minimize();
+        alpha[r] = fitter->X()[0];
+        status[r] = fitter->Status();
+    });
+    for (int t=0;t<nthreads;t++) delete fitters[t];
+
+    double mean = 0;
+    int ngood = 0;
+    for (int r=0;r<nreplicas;r++) {
+        if (status[r]!=0) continue;
+        mean += alpha[r];
+        ngood++;
+    }
+    if (ngood<2) {
+        std::cout<<"Too few converged replicas ("<<ngood<<")"<<std::endl;
+        return;
+    }
+    mean /= ngood;
+    double var = 0;
+    for (int r=0;r<nreplicas;r++)
+        if (status[r]==0) var += (alpha[r]-mean)*(alpha[r]-mean);
+    // jackknife variance is inflated by (n-1) with respect to the spread of the leave-one-out estimates
+    double err = jackknife ? sqrt(var*(ngood-1.)/ngood) : sqrt(var/(ngood-1.));
+
+    TH1D* hAlpha = new TH1D("","",50,mean-5*err,mean+5*err);
+    for (int r=0;r<nreplicas;r++)
+        if (status[r]==0) hAlpha->Fill(alpha[r]);
+    TCanvas* c1 = new TCanvas();
+    hAlpha->GetXaxis()->SetTitle("#alpha (cm)");
+    hAlpha->Draw();
+    c1->SaveAs(Form("alpha_%s_%i.pdf",jackknife ? "jackknife" : "bootstrap",nmPMT_on));
+
+    std::cout<<"Converged replicas = "<<ngood<<"/"<<nreplicas<<std::endl;
+    std::cout<<"Nominal alpha = "<<nominal.par[0]<<" +/- "<<nominal.err[0]<<" (Hesse)"<<std::endl;
+    std::cout<<(jackknife ? "Jackknife" : "Bootstrap")<<" alpha mean = "<<mean<<", error = "<<err<<std::endl;
+}
+
+// Channel selections as bitsets over the mPMT channels, bit set = channel in use
+typedef std::vector<unsigned long long> ChannelBits;
+
+ChannelBits channel_bits(const std::vector<char>& use)
+{
+    ChannelBits bits((use.size()+63)/64,0);
+    for (size_t i=0;i<use.size();i++)
+        if (use[i]) bits[i/64] |= 1ULL<<(i%64);
+    return bits;
+}
+
+ChannelBits channel_bits(const std::vector<int>& mask)
+{
+    ChannelBits bits((mask.size()+63)/64,0);
+    for (size_t i=0;i<mask.size();i++)
+        if (!mask[i]) bits[i/64] |= 1ULL<<(i%64);
+    return bits;
+}
+
+// Modules switched on in a mask file: one module number (PMT_id/19) per line, lines starting with # are ignored
+ChannelBits read_module_bits(std::string filename, int nmPMT_sim)
+{
+    ChannelBits bits((nmPMT_sim+63)/64,0);
+    std::ifstream in(filename.c_str());
+    if (!in) std::cout<<"Could not open mask file "<<filename<<std::endl;
+    std::string line;
+    int nline = 0;
+    while (std::getline(in,line)) {
+        nline++;
+        std::istringstream ss(line.substr(0,line.find('#')));
+        std::string token, rest;
+        if (!(ss>>token)) continue; // blank or comment only
+        std::istringstream number(token);
+        int module;
+        if (!(number>>module) || !number.eof() || (ss>>rest)) {
+            std::cout<<"Skipping malformed line "<<nline<<" of mask file "<<filename<<": "<<line<<std::endl;
+            continue;
+        }
+        for (int j=module*nPMTpermPMT;j<(module+1)*nPMTpermPMT && j<nmPMT_sim;j++)
+            if (j>=0) bits[j/64] |= 1ULL<<(j%64);
+    }
+    return bits;
+}
+
+// Fit many mPMT module masks from one pass over the data. The per-PMT charge totals are read once by fit_all with
+// all modules on, each mask (uniform nmPMT_on values or module lists from files) is applied as a bitwise AND with
+// the opening angle selection, and the masks are fitted concurrently on nthreads threads.
+void fit_mask_study(    std::string filename, std::vector<int> nmPMT_on_list,
+                        std::vector<std::string> mask_files = std::vector<std::string>(), int nthreads = 4,
+                        bool mPMT = true, bool PMT = true,
+                        double timetof_min = -952, double timetof_max = -945,
+                        int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1.,
+                        int nbins_dist=100, double dist_min = 1000, double dist_max=9000,
+                        double cosths_min = 0.766
+                   )
+{
+    if (!fit_all(filename,0,mPMT,PMT,timetof_min,timetof_max,nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min))
+        return;
+    FitResult nominal = fit_result;
+    const double* rate0 = hRate0->GetArray()+1;
+    const double* rate1 = hRate1->GetArray()+1;
+    ChannelBits selected = channel_bits(geom.mPMT_use);
+
+    std::vector<std::string> labels;
+    std::vector<ChannelBits> masks;
+    for (size_t k=0;k<nmPMT_on_list.size();k++) {
+        labels.push_back(Form("nmPMT_on = %i",nmPMT_on_list[k]));
+        masks.push_back(channel_bits(uniform_mPMT_mask(nmPMT_on_list[k],nmPMT_sim)));
+    }
+    for (size_t k=0;k<mask_files.size();k++) {
+        labels.push_back(mask_files[k]);
+        masks.push_back(read_module_bits(mask_files[k],nmPMT_sim));
+    }
+    int nmasks = masks.size();
+
+    // use flags of each mask and fitters with the parameters of empty costh bins fixed, set up before fitting
+    LikelihoodConfig cfg = likelihood_config();
+    int npar = nominal.par.size();
+    std::vector<std::vector<char> > mPMT_use(nmasks);
+    std::vector<int> nchannels(nmasks,0);
+    std::vector<ROOT::Math::Minimizer*> fitters(nmasks);
+    for (int m=0;m<nmasks;m++) {
+        for (size_t w=0;w<masks[m].size();w++) masks[m][w] &= selected[w];
+        mPMT_use[m].assign(nmPMT_sim,0);
+        std::vector<double> rate_costh(nbins_costh+2,0), rate_costh_mPMT(nbins_costh+2,0);
+        for (int i=0;i<nmPMT_sim;i++) {
+            if (!(masks[m][i/64]>>(i%64) & 1)) continue;
+            mPMT_use[m][i] = 1;
+            nchannels[m]++;
+            rate_costh[cfg.FindBin(geom.mPMT_costh[i])] += rate1[i];
+            rate_costh_mPMT[cfg.FindBin(geom.mPMT_costh_mPMT[i])] += rate1[i];
+        }
+        fitters[m] = create_fitter("Minuit2","Migrad",0);
+        for (int i=1;i<=nbins_costh;i++) {
+            if (rate_costh[i]<0.00001) fitters[m]->FixVariable(i);
+            double rate20 = hBinnedRate0->Integral(i,i,1,hBinnedRate0->GetNbinsY());
+            if (rate20<0.00001 && rate_costh_mPMT[i]<0.00001) fitters[m]->FixVariable(i+2*nbins_costh);
+        }
+    }
+
+    ROOT::EnableThreadSafety();
+    LikelihoodKernel kernel = SelectLikelihood(cfg);
+    std::vector<double> alpha(nmasks,0), alpha_err(nmasks,0);
+    std::vector<int> status(nmasks,-1);
+    run_parallel(nmasks,nthreads,[&](int m, int t) {
+        ChannelView g = geom.view();
+        g.mPMT_use = mPMT_use[m].data();
+        ROOT::Math::Functor fcn([=](const double* par) { return kernel(par,cfg,g,rate0,rate1,1.); }, npar);
+        ROOT::Math::Minimizer* fitter = fitters[m];
+        fitter->SetFunction(fcn);
+        fitter->SetVariableValues(nominal.par.data());
+        fitter->Minimize();
+        fitter->Hesse();
+        alpha[m] = fitter->X()[0];
+        alpha_err[m] = fitter->Errors()[0];
+        status[m] = fitter->Status();
+    });
+    for (int m=0;m<nmasks;m++) delete fitters[m];
+
+    std::cout<<"Mask study results:"<<std::endl;
+    std::cout<<"all modules: "<<nominal.par[0]<<" +/- "<<nominal.err[0]<<std::endl;
+    for (int m=0;m<nmasks;m++) {
+        std::cout<<labels[m]<<" ("<<nchannels[m]<<" mPMT channels): alpha = "<<alpha[m]<<" +/- "<<alpha_err[m]
+                 <<", status "<<status[m]<<std::endl;
+    }
+}
+
+// Crossings of delta chi2 = level on both sides of the minimum kmin of a scan, linearly interpolated between points.
+// A side without a crossing inside the scan range gives NaN.
+void profile_interval(const std::vector<double>& x, const std::vector<double>& dchi2, int kmin, double level,
+                      double& low, double& up)
+{
+    low = up = std::numeric_limits<double>::quiet_NaN();
+    for (int k=kmin;k>0;k--) {
+        if (dchi2[k-1]>=level) {
+            low = x[k-1]+(x[k]-x[k-1])*(dchi2[k-1]-level)/(dchi2[k-1]-dchi2[k]);
+            break;
+        }
+    }
+    for (int k=kmin;k<(int)x.size()-1;k++) {
+        if (dchi2[k+1]>=level) {
+            up = x[k]+(x[k+1]-x[k])*(level-dchi2[k])/(dchi2[k+1]-dchi2[k]);
+            break;
+        }
+    }
+}
+
+// Profile likelihood scan of alpha over npoints values in nominal +/- nsigma Hesse errors, with all other parameters
+// refitted at each point. The grid is split into segments walked outwards from the nominal fit, each point starting
+// from the result of its neighbour, and the segments are fitted on nthreads threads. The delta chi2 curve is saved
+// as a pdf and the 1 and 2 sigma intervals are printed.
+void fit_profile_alpha( std::string filename, int npoints = 100, double nsigma = 3, int nthreads = 4,
+                        int nmPMT_on=0, bool mPMT = true, bool PMT = true,
+                        double timetof_min = -952, double timetof_max = -945
+                      )
+{
+    if (!fit_all(filename,nmPMT_on,mPMT,PMT,timetof_min,timetof_max)) return;
+    FitResult nominal = fit_result;
+    if (nominal.status!=0 || nominal.err[0]<=0 || npoints<2) {
+        std::cout<<"Nominal fit did not converge, no scan"<<std::endl;
+        return;
+    }
+    const double* rate0 = hRate0->GetArray()+1;
+    const double* rate1 = hRate1->GetArray()+1;
+    int npar = nominal.par.size();
+
+    std::vector<double> alpha(npoints);
+    for (int k=0;k<npoints;k++) alpha[k] = nominal.par[0]+nsigma*nominal.err[0]*(2.*k/(npoints-1)-1);
+    int k0 = std::lower_bound(alpha.begin(),alpha.end(),nominal.par[0])-alpha.begin();
+
+    // points below and above the nominal alpha, ordered outwards, cut into contiguous segments
+    std::vector<std::vector<int> > segments;
+    std::vector<int> first_on_side; // whether the segment is the innermost one of its side
+    int nseg = std::max(1,nthreads/2);
+    for (int side=0;side<2;side++) {
+        std::vector<int> points;
+        if (side==0) for (int k=k0-1;k>=0;k--) points.push_back(k);
+        else for (int k=k0;k<npoints;k++) points.push_back(k);
+        for (int j=0;j<nseg;j++) {
+            size_t first = points.size()*j/nseg, last = points.size()*(j+1)/nseg;
+            if (last>first) {
+                first_on_side.push_back(first==0);
+                segments.push_back(std::vector<int>(points.begin()+first,points.begin()+last));
+            }
+        }
+    }
+    int nsegments = segments.size();
+    std::vector<ROOT::Math::Minimizer*> fitters;
+    for (int j=0;j<nsegments;j++) {
+        fitters.push_back(create_fitter("Minuit2","Migrad",0));
+        fitters[j]->FixVariable(0);
+    }
+
+    std::vector<double> chi2(npoints,0);
+    std::vector<int> status(npoints,-1);
+    // coarse serial pass over the segment heads, each starting from the head of the previous segment on its side
+    // rather than from the nominal values, which are far off for the outer segments
+    std::vector<std::vector<double> > head_par(nsegments);
+    {
+        ROOT::Math::Functor fcn([=](const double* par) { return EvalLikelihood(par,rate0,rate1); }, npar);
+        fitters[0]->SetFunction(fcn);
+        std::vector<double> start = nominal.par;
+        for (int j=0;j<nsegments;j++) {
+            if (first_on_side[j]) start = nominal.par;
+            int k = segments[j][0];
+            start[0] = alpha[k];
+            fitters[0]->SetVariableValues(start.data());
+            fitters[0]->Minimize();
+            chi2[k] = fitters[0]->MinValue();
+            status[k] = fitters[0]->Status();
+            head_par[j].assign(fitters[0]->X(),fitters[0]->X()+npar);
+            if (status[k]==0) start = head_par[j];
+        }
+    }
+
+    ROOT::EnableThreadSafety();
+    run_parallel(nsegments,nthreads,[&](int j, int t) {
+        ROOT::Math::Functor fcn([=](const double* par) { return EvalLikelihood(par,rate0,rate1); }, npar);
+        ROOT::Math::Minimizer* fitter = fitters[j];
+        fitter->SetFunction(fcn);
+        std::vector<double> start = status[segments[j][0]]==0 ? head_par[j] : nominal.par;
+        for (size_t p=1;p<segments[j].size();p++) {
+            int k = segments[j][p];
+            start[0] = alpha[k];
+            fitter->SetVariableValues(start.data());
+            fitter->Minimize();
+            chi2[k] = fitter->MinValue();
+            status[k] = fitter->Status();
+            start.assign(fitter->X(),fitter->X()+npar);
+        }
+    });
+    for (int j=0;j<nsegments;j++) delete fitters[j];
+
+    std::vector<double> x, dchi2;
+    int kmin = 0;
+    double chi2_min = nominal.minValue;
+    for (int k=0;k<npoints;k++) {
+        if (status[k]!=0) continue;
+        chi2_min = std::min(chi2_min,chi2[k]);
+    }
+    for (int k=0;k<npoints;k++) {
+        if (status[k]!=0) continue;
+        if (!dchi2.empty() && chi2[k]-chi2_min<dchi2[kmin]) kmin = x.size();
+        x.push_back(alpha[k]);
+        dchi2.push_back(chi2[k]-chi2_min);
+    }
+    if (x.size()<2) {
+        std::cout<<"Too few converged scan points ("<<x.size()<<")"<<std::endl;
+        return;
+    }
+    if (chi2_min<nominal.minValue-0.01)
+        std::cout<<"Warning: the scan found a lower minimum at alpha = "<<x[kmin]<<" (delta chi2 = "
+                 <<chi2_min-nominal.minValue<<" with respect to the nominal fit)"<<std::endl;
+
+    TGraph* gProfile = new TGraph(x.size(),x.data(),dchi2.data());
+    TCanvas* c1 = new TCanvas();
+    gProfile->SetTitle("");
+    gProfile->GetXaxis()->SetTitle("#alpha (cm)");
+    gProfile->GetYaxis()->SetTitle("#Delta#chi^{2}");
+    gProfile->Draw("APL");
+    c1->SaveAs(Form("alpha_profile_%i.pdf",nmPMT_on));
+
+    std::cout<<"Converged scan points = "<<x.size()<<"/"<<npoints<<std::endl;
+    std::cout<<"Nominal alpha = "<<nominal.par[0]<<" +/- "<<nominal.err[0]<<" (Hesse)"<<std::endl;
+    for (int n=1;n<=2;n++) {
+        double low, up;
+        profile_interval(x,dchi2,kmin,n*n,low,up);
+        std::cout<<n<<" sigma interval: ["<<low<<", "<<up<<"], alpha = "<<x[kmin]<<" "<<low-x[kmin]<<" +"<<up-x[kmin]<<std::endl;
+    }
+}
+
+// Joint fit of all source positions found in the input files. Sources are matched across files by position,
+// each one uses its own geometry table and intensity parameter, and alpha and the angular normalizations are shared.
+// The likelihood terms of the sources are evaluated on nthreads threads.
+void fit_sources(   std::string filename, int nthreads = 4, bool mPMT = true, bool PMT = true,
+                    double timetof_min = -952, double timetof_max = -940,
+                    int nbins_costh = 50, double costh_min = 0.5, double costh_max = 1.,
+                    int nbins_dist=100, double dist_min = 1000, double dist_max=9000,
+                    double cosths_min = 0.766
+                )
+{
+    usemPMT = mPMT;
+    usePMT = PMT;
+    unload_fit_inputs();
+    fit_nthreads = nthreads;
+    fit_config = {filename+" (joint sources)",0,mPMT,PMT,timetof_min,timetof_max,
+                  nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min,
+                  "fit_sources",input_fingerprint(filename)};
+
+    // match the source positions of all files
+    TChain* hitRate_pmtType1 = new TChain("hitRate_pmtType1");
+    hitRate_pmtType1->Add(filename.c_str());
+    if (!check_chain_ttree(hitRate_pmtType1)) return;
+    TObjArray* files = hitRate_pmtType1->GetListOfFiles();
+    std::vector<std::vector<double> > positions;
+    std::vector<std::string> geom_file; // file and local source_id the geometry of each source is read from
+    std::vector<int> geom_local;
+    std::vector<std::vector<int> > file_sources; // local source_id -> source, per file
+    for (int ifile=0;ifile<files->GetEntries();ifile++) {
+        const char* fname = files->At(ifile)->GetTitle();
+        TFile* f = TFile::Open(fname);
+        TTree* sources = f ? (TTree*)f->Get("sources") : 0;
+        if (!sources) {
+            std::cout<<"No sources tree in "<<fname<<", rerun analysis_absorption"<<std::endl;
+            return;
+        }
+        int source_id;
+        double vtx[3];
+        sources->SetBranchAddress("source_id",&source_id);
+        sources->SetBranchAddress("vtx_x",&vtx[0]);
+        sources->SetBranchAddress("vtx_y",&vtx[1]);
+        sources->SetBranchAddress("vtx_z",&vtx[2]);
+        std::vector<int> local(sources->GetEntries(),-1);
+        for (int i=0;i<sources->GetEntries();i++) {
+            sources->GetEntry(i);
+            for (size_t s=0;s<positions.size() && local[source_id]<0;s++)
+                if (fabs(positions[s][0]-vtx[0])<1 && fabs(positions[s][1]-vtx[1])<1 && fabs(positions[s][2]-vtx[2])<1)
+                    local[source_id] = s;
+            if (local[source_id]<0) {
+                local[source_id] = positions.size();
+                positions.push_back(std::vector<double>(vtx,vtx+3));
+                geom_file.push_back(fname);
+                geom_local.push_back(source_id);
+            }
+        }
+        file_sources.push_back(local);
+        f->Close();
+    }
+    int nsources = positions.size();
+    std::cout<<"Found "<<nsources<<" source positions"<<std::endl;
+
+    source_geom.assign(nsources,ChannelGeometry());
+    for (int s=0;s<nsources;s++) {
+        TFile* f = TFile::Open(geom_file[s].c_str());
+        load_pmt_geometry(f,0,nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max,cosths_min,geom_local[s],source_geom[s]);
+    }
+    source_rate0.assign(nsources,std::vector<double>(nPMT_sim,0));
+    source_rate1.assign(nsources,std::vector<double>(nmPMT_sim,0));
+
+    double nPE, timetof;
+    int PMT_id, source_id;
+    for (int pmtType=0;pmtType<2;pmtType++) {
+        TChain* hitRate = new TChain(Form("hitRate_pmtType%i",pmtType));
+        hitRate->Add(filename.c_str());
+        hitRate->SetBranchStatus("*",false);
+        hitRate->SetBranchStatus("nPE",true);
+        hitRate->SetBranchStatus("timetof",true);
+        hitRate->SetBranchStatus("PMT_id",true);
+        hitRate->SetBranchStatus("source_id",true);
+        hitRate->SetBranchAddress("nPE",&nPE);
+        hitRate->SetBranchAddress("timetof",&timetof);
+        hitRate->SetBranchAddress("PMT_id",&PMT_id);
+        hitRate->SetBranchAddress("source_id",&source_id);
+        for (ULong64_t i=0;i<hitRate->GetEntries();i++) {
+            hitRate->GetEntry(i);
+            if (timetof<=timetof_min || timetof>=timetof_max) continue;
+            int s = file_sources[hitRate->GetTreeNumber()][source_id];
+            int idx = pmtType==0 ? PMT_id-min_PMTid : PMT_id;
+            std::vector<char>& use = pmtType==0 ? source_geom[s].PMT_use : source_geom[s].mPMT_use;
+            if (!use[idx]) continue;
+            if (pmtType==0) source_rate0[s][idx] += nPE;
+            else source_rate1[s][idx] += nPE;
+        }
+        delete hitRate;
+    }
+    delete hitRate_pmtType1;
+
+    // summed rates of all sources, used for the parameter fixing and the number of costh bins
+    TH1::SetDefaultSumw2(true);
+    hRate1 = new TH1D("","",nmPMT_sim,0,nmPMT_sim);
+    hBinnedRate1 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hBinnedRate1mPMT = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    hRate0 = new TH1D("","",nPMT_sim,0,nPMT_sim);
+    hBinnedRate0 = new TH2D("","",nbins_costh,costh_min,costh_max,nbins_dist,dist_min,dist_max);
+    for (int s=0;s<nsources;s++) {
+        const ChannelGeometry& g = source_geom[s];
+        for (int i=0;i<nmPMT_sim;i++) {
+            if (source_rate1[s][i]<=0) continue;
+            hRate1->Fill(i+0.5,source_rate1[s][i]);
+            hBinnedRate1->Fill(g.mPMT_costh[i],g.mPMT_R[i],source_rate1[s][i]);
+            hBinnedRate1mPMT->Fill(g.mPMT_costh_mPMT[i],g.mPMT_R[i],source_rate1[s][i]);
+        }
+        for (int i=0;i<nPMT_sim;i++) {
+            if (source_rate0[s][i]<=0) continue;
+            hRate0->Fill(i+0.5,source_rate0[s][i]);
+            hBinnedRate0->Fill(g.PMT_costh[i],g.PMT_R[i],source_rate0[s][i]);
+        }
+    }
+
+    run_fit();
+
+    std::cout<<"Source positions and intensities:"<<std::endl;
+    for (int s=0;s<nsources;s++) {
+        std::cout<<"  ("<<positions[s][0]<<", "<<positions[s][1]<<", "<<positions[s][2]<<"): ";
+        if (s==0) std::cout<<"1 (reference)"<<std::endl;
+        else std::cout<<fit_result.par[nbins_costh*3+s]<<" +/- "<<fit_result.err[nbins_costh*3+s]<<std::endl;
+    }
+}
+
+// Read the hits of a single PMT within (timetof_min, timetof_max) from a file written by analysis_absorption -p,
+// using the hitIndex_pmtType* offset index instead of scanning the whole hitRate_pmtType* tree.
+// Returns the number of hits found, or -1 if the file has no index.
+int read_pmt_hits(  const char* filename, int pmtType, int pmt_id,
+                    double timetof_min, double timetof_max,
+                    std::vector<double>& hit_timetof, std::vector<double>& hit_nPE)
+{
+    hit_timetof.clear(); hit_nPE.clear();
+    TFile* f = TFile::Open(filename);
+    if (!f || !f->IsOpen()) return -1;
+    TTree* hitIndex = (TTree*)f->Get(Form("hitIndex_pmtType%i",pmtType));
+    TTree* hitRate = (TTree*)f->Get(Form("hitRate_pmtType%i",pmtType));
+    if (!hitIndex || !hitRate) {
+        std::cout<<"No PMT-sorted index in "<<filename<<", rerun analysis_absorption with -p"<<std::endl;
+        f->Close();
+        return -1;
+    }
+
+    int PMT_id;
+    Long64_t first, nEntries;
+    hitIndex->SetBranchAddress("PMT_id",&PMT_id);
+    hitIndex->SetBranchAddress("first",&first);
+    hitIndex->SetBranchAddress("nEntries",&nEntries);
+
+    // index rows are ordered by PMT_id
+    Long64_t lo = 0, hi = hitIndex->GetEntries();
+    while (lo<hi) {
+        Long64_t mid = (lo+hi)/2;
+        hitIndex->GetEntry(mid);
+        if (PMT_id<pmt_id) lo = mid+1;
+        else hi = mid;
+    }
+    if (lo==hitIndex->GetEntries()) { f->Close(); return 0; }
+    hitIndex->GetEntry(lo);
+    if (PMT_id!=pmt_id) { f->Close(); return 0; }
+
+    double timetof, nPE;
+    hitRate->SetBranchStatus("*",false);
+    hitRate->SetBranchStatus("timetof",true);
+    hitRate->SetBranchStatus("nPE",true);
+    hitRate->SetBranchAddress("timetof",&timetof);
+    hitRate->SetBranchAddress("nPE",&nPE);
+
+    // hits are ordered by timetof within the PMT range, find the first one inside the window
+    lo = first; hi = first+nEntries;
+    while (lo<hi) {
+        Long64_t mid = (lo+hi)/2;
+        hitRate->GetEntry(mid);
+        if (timetof<=timetof_min) lo = mid+1;
+        else hi = mid;
+    }
+    for (Long64_t i=lo;i<first+nEntries;i++) {
+        hitRate->GetEntry(i);
+        if (timetof>=timetof_max) break;
+        hit_timetof.push_back(timetof);
+        hit_nPE.push_back(nPE);
+    }
+    f->Close();
 
+    return hit_timetof.size();
 }
 
 void fit_water_attenuation(){
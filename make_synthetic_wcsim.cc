@@ -0,0 +1,194 @@
+// Write a synthetic WCSim output file (wcsimT, wcsimGeoT and wcsimRootOptionsT) for benchmarking the reduction
+// without a real production. A diffuser on the barrel wall lights randomly chosen PMTs of a cylindrical detector,
+// with the raw photon times and digitized hits filled as WCSim would.
+#include <iostream>
+#include <vector>
+#include <random>
+#include <unistd.h>
+#include <TROOT.h>
+#include <TFile.h>
+#include <TTree.h>
+#include <TMath.h>
+#include "WCSimRootEvent.hh"
+#include "WCSimRootGeom.hh"
+#include "WCSimRootOptions.hh"
+
+using namespace std;
+
+const double cylRadius = 3240; // cm
+const double cylHalfLength = 3290; // cm
+
+// Uniform position on the detector wall with the inward normal as orientation. cyl_loc is 0 = top, 1 = barrel, 2 = bottom
+void WallPosition(std::mt19937& rng, double* pos, double* dir, int& cyl_loc) {
+  std::uniform_real_distribution<double> u(0,1);
+  double barrelArea = 2*TMath::Pi()*cylRadius*2*cylHalfLength;
+  double capArea = TMath::Pi()*cylRadius*cylRadius;
+  double x = u(rng)*(barrelArea+2*capArea);
+  double phi = 2*TMath::Pi()*u(rng);
+  if (x<barrelArea) {
+    cyl_loc = 1;
+    pos[0] = cylRadius*cos(phi); pos[1] = cylRadius*sin(phi); pos[2] = (2*u(rng)-1)*cylHalfLength;
+    dir[0] = -cos(phi); dir[1] = -sin(phi); dir[2] = 0;
+  } else {
+    bool top = x<barrelArea+capArea;
+    cyl_loc = top ? 0 : 2;
+    double r = cylRadius*sqrt(u(rng));
+    pos[0] = r*cos(phi); pos[1] = r*sin(phi); pos[2] = top ? cylHalfLength : -cylHalfLength;
+    dir[0] = 0; dir[1] = 0; dir[2] = top ? -1 : 1;
+  }
+}
+
+int main(int argc, char **argv){
+
+  char * outfilename=NULL;
+  int nevent = 100;
+  int nPMT = 20000; // B&L PMTs
+  int nmPMT = 800; // mPMT modules of 19 PMTs
+  int hitsPerEvent = 2000; // hit PMTs per event and PMT type
+  double photonsPerHit = 1.3;
+  bool hybrid = true;
+  unsigned int seed = 12345;
+  char c;
+  while( (c = getopt(argc,argv,"o:n:b:m:p:q:r:h")) != -1 ){
+    switch(c){
+      case 'o':
+        outfilename = optarg;
+        break;
+      case 'n':
+        nevent = std::stoi(optarg);
+        break;
+      case 'b':
+        nPMT = std::stoi(optarg);
+        break;
+      case 'm':
+        nmPMT = std::stoi(optarg);
+        break;
+      case 'p':
+        hitsPerEvent = std::stoi(optarg);
+        break;
+      case 'q':
+        photonsPerHit = std::stod(optarg);
+        break;
+      case 'r':
+        seed = std::stoul(optarg);
+        break;
+      case 'h':
+        hybrid = false; // no mPMT
+        break;
+      default:
+        cout << "Usage: make_synthetic_wcsim -o output.root [-n events] [-b B&L PMTs] [-m mPMT modules] [-p hits per event] [-q photons per hit] [-r seed] [-h]" << endl;
+        return 0;
+    }
+  }
+  if (outfilename==NULL) {
+    cout << "Error, no output file" << endl;
+    return -1;
+  }
+  if (photonsPerHit<1) photonsPerHit = 1;
+  std::mt19937 rng(seed);
+
+  TFile * outfile = new TFile(outfilename,"RECREATE");
+
+  // Geometry
+  WCSimRootGeom* geo = new WCSimRootGeom();
+  geo->SetGeo_Type(0);
+  geo->SetWCCylRadius(cylRadius);
+  geo->SetWCCylLength(2*cylHalfLength);
+  geo->SetWCPMTRadius(25.4);
+  geo->SetWCNumPMT(nPMT);
+  double pos[3], dir[3];
+  int cyl_loc;
+  for (int i=0;i<nPMT;i++) {
+    WallPosition(rng,pos,dir,cyl_loc);
+    geo->SetPMT(i,i+1,0,0,cyl_loc,dir,pos,true,false);
+  }
+  if (hybrid) {
+    // 19 PMTs per module, the 19th is the central one facing along the module axis
+    geo->SetWCPMTRadius(4,true);
+    geo->SetWCNumPMT(nmPMT*19,true);
+    for (int m=0;m<nmPMT;m++) {
+      WallPosition(rng,pos,dir,cyl_loc);
+      for (int k=0;k<19;k++) {
+        int i = m*19+k;
+        geo->SetPMT(i,i+1,m+1,k+1,cyl_loc,dir,pos,true,true);
+      }
+    }
+  }
+  TTree* geotree = new TTree("wcsimGeoT","Geometry Tree");
+  geotree->Branch("wcsimrootgeom","WCSimRootGeom",&geo,64000,0);
+  geotree->Fill();
+
+  WCSimRootOptions* opt = new WCSimRootOptions();
+  TTree* opttree = new TTree("wcsimRootOptionsT","Options Tree");
+  opttree->Branch("wcsimrootoptions","WCSimRootOptions",&opt,64000,0);
+  opttree->Fill();
+
+  // Events
+  WCSimRootEvent* wcsimrootsuperevent = new WCSimRootEvent();
+  WCSimRootEvent* wcsimrootsuperevent2 = new WCSimRootEvent();
+  wcsimrootsuperevent->Initialize();
+  wcsimrootsuperevent2->Initialize();
+  TTree* tree = new TTree("wcsimT","WCSim Tree");
+  tree->Branch("wcsimrootevent","WCSimRootEvent",&wcsimrootsuperevent,64000,2);
+  if (hybrid) tree->Branch("wcsimrootevent2","WCSimRootEvent",&wcsimrootsuperevent2,64000,2);
+
+  double vtxpos[3] = {-(cylRadius-10), 0, 0}; // diffuser on the barrel wall
+  double vg = 21.8; // photon group velocity in cm/ns
+  double triggerTime = -950; // so that the digitized timetof is around the window used in the fit
+  std::uniform_real_distribution<double> u(0,1);
+  std::exponential_distribution<double> scatterDelay(0.5); // ns
+  std::poisson_distribution<int> extraPhotons(photonsPerHit-1);
+  std::normal_distribution<double> charge(1,0.3);
+  long nHitsTotal = 0, nPhotonsTotal = 0;
+  for (int ev=0;ev<nevent;ev++) {
+    for (int pmtType=0;pmtType<(hybrid ? 2 : 1);pmtType++) {
+      WCSimRootTrigger* trigger = (pmtType==0 ? wcsimrootsuperevent : wcsimrootsuperevent2)->GetTrigger(0);
+      trigger->SetHeader(ev,1,0);
+      trigger->SetMode(0);
+      for (int j=0;j<3;j++) trigger->SetVtx(j,vtxpos[j]);
+      std::vector<double> triggerInfo = {(double)hitsPerEvent, 0, triggerTime};
+      trigger->SetTriggerInfo(kTriggerNDigits,triggerInfo);
+      int nTubes = pmtType==0 ? nPMT : nmPMT*19;
+      double sumQ = 0;
+      for (int h=0;h<hitsPerEvent && nTubes>0;h++) {
+        int tube = std::min(nTubes-1,(int)(u(rng)*nTubes));
+        WCSimRootPMT pmt = geo->GetPMT(tube,pmtType==1);
+        double dist = 0;
+        for (int j=0;j<3;j++) dist += (pmt.GetPosition(j)-vtxpos[j])*(pmt.GetPosition(j)-vtxpos[j]);
+        dist = sqrt(dist);
+        int nPhotons = 1+extraPhotons(rng);
+        std::vector<double> truetime(nPhotons);
+        std::vector<int> parentID(nPhotons,0);
+        std::vector<int> photonIDs(nPhotons);
+        double firstTime = 1e9;
+        for (int k=0;k<nPhotons;k++) {
+          truetime[k] = dist/vg+scatterDelay(rng);
+          photonIDs[k] = k;
+          firstTime = std::min(firstTime,truetime[k]);
+        }
+        int mPMTNo = pmtType==1 ? pmt.GetmPMTNo() : 0;
+        int mPMT_PMTNo = pmtType==1 ? pmt.GetmPMT_PMTNo() : 0;
+        trigger->AddCherenkovHit(tube+1,mPMTNo,mPMT_PMTNo,truetime,parentID);
+        double q = std::max(0.1,nPhotons*charge(rng));
+        trigger->AddCherenkovDigiHit(q,firstTime,tube+1,mPMTNo,mPMT_PMTNo,photonIDs);
+        sumQ += q;
+        nHitsTotal++;
+        nPhotonsTotal += nPhotons;
+      }
+      trigger->SetNumDigitizedTubes(hitsPerEvent);
+      trigger->SetSumQ(sumQ);
+    }
+    tree->Fill();
+    wcsimrootsuperevent->ReInitialize();
+    if (hybrid) wcsimrootsuperevent2->ReInitialize();
+  }
+
+  outfile->cd();
+  tree->Write();
+  geotree->Write();
+  opttree->Write();
+  outfile->Close();
+  cout << "Wrote " << nevent << " events, " << nHitsTotal << " hits, " << nPhotonsTotal << " photons to " << outfilename << endl;
+
+  return 0;
+}